@@ -0,0 +1,171 @@
+/* -------------------------------------------------------------------------
+ *
+ * command.c
+ *
+ * Command channel from backends to the keeper process.
+ *
+ * Backends tell the keeper what happened, e.g. a node was added, by typed
+ * commands put into a ring buffer in the registry, and wake the keeper up by
+ * setting its latch. Since the keeper must see the modification of the
+ * management table, the commands made by a transaction are held in backend
+ * local memory and put into the queue only when the transaction commits.
+ * The keeper drains the queue at once and coalesces the commands, so a burst
+ * of commands leads to one reload. If the queue is full, the commands are
+ * dropped and the keeper is told to reload everything instead.
+ *
+ * We don't use shm_mq because there are many senders.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pg_keeper.h"
+
+#include "access/xact.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+
+/* Commands made by current transaction, sent at commit */
+static KeeperCommand pending_commands[KEEPER_COMMAND_QUEUE_SIZE];
+static int	n_pending_commands = 0;
+static bool pending_overflow = false;
+
+static void enqueueCommands(KeeperCommand *commands, int ncommands,
+							bool overflow);
+
+/*
+ * Send a command to the keeper. If at_commit is true, the command is sent when
+ * current transaction commits, or discarded if it aborts.
+ */
+void
+sendKeeperCommand(KeeperCommandType type, const char *name, bool at_commit)
+{
+	KeeperCommand command;
+
+	command.type = type;
+	if (name != NULL)
+		strlcpy(command.name, name, NAMEDATALEN);
+	else
+		command.name[0] = '\0';
+
+	if (!at_commit)
+	{
+		enqueueCommands(&command, 1, false);
+		return;
+	}
+
+	if (n_pending_commands >= KEEPER_COMMAND_QUEUE_SIZE)
+	{
+		pending_overflow = true;
+		return;
+	}
+
+	pending_commands[n_pending_commands++] = command;
+}
+
+/*
+ * Put commands into the queue and wake the keeper up.
+ */
+static void
+enqueueCommands(KeeperCommand *commands, int ncommands, bool overflow)
+{
+	int i;
+
+	LWLockAcquire(KeeperShmem->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < ncommands; i++)
+	{
+		if (KeeperShmem->command_head - KeeperShmem->command_tail >=
+			KEEPER_COMMAND_QUEUE_SIZE)
+		{
+			overflow = true;
+			break;
+		}
+
+		KeeperShmem->commands[KeeperShmem->command_head % KEEPER_COMMAND_QUEUE_SIZE] =
+			commands[i];
+		KeeperShmem->command_head++;
+	}
+
+	if (overflow)
+		KeeperShmem->command_overflow = true;
+
+	LWLockRelease(KeeperShmem->lock);
+
+	if (KeeperShmem->keeper_latch != NULL)
+		SetLatch(KeeperShmem->keeper_latch);
+}
+
+/*
+ * Drain the queue and coalesce the commands into set. Called by the keeper.
+ */
+void
+receiveKeeperCommands(KeeperCommandSet *set)
+{
+	memset(set, 0, sizeof(KeeperCommandSet));
+
+	LWLockAcquire(KeeperShmem->lock, LW_EXCLUSIVE);
+
+	while (KeeperShmem->command_tail != KeeperShmem->command_head)
+	{
+		KeeperCommand *command;
+
+		command = &(KeeperShmem->commands[KeeperShmem->command_tail %
+										  KEEPER_COMMAND_QUEUE_SIZE]);
+		KeeperShmem->command_tail++;
+
+		switch (command->type)
+		{
+			case KEEPER_CMD_NODE_ADDED:
+			case KEEPER_CMD_NODE_REMOVED:
+			case KEEPER_CMD_NODE_CHANGED:
+				set->reload_nodes = true;
+				break;
+			case KEEPER_CMD_RELOAD_CONFIG:
+				set->reload_config = true;
+				break;
+			case KEEPER_CMD_FORCE_PROBE:
+				set->force_probe = true;
+				break;
+		}
+
+		ereport(DEBUG1,
+				(errmsg("pg_keeper received command %d for node \"%s\"",
+						command->type, command->name)));
+	}
+
+	/* We don't know what we missed */
+	if (KeeperShmem->command_overflow)
+	{
+		set->reload_nodes = true;
+		KeeperShmem->command_overflow = false;
+	}
+
+	LWLockRelease(KeeperShmem->lock);
+}
+
+/*
+ * Transaction callback sending the commands made by the transaction at commit.
+ */
+void
+keeperXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			if (n_pending_commands > 0 || pending_overflow)
+				enqueueCommands(pending_commands, n_pending_commands,
+								pending_overflow);
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			break;
+		default:
+			/* Keep the commands until the transaction ends */
+			return;
+	}
+
+	n_pending_commands = 0;
+	pending_overflow = false;
+}
@@ -0,0 +1,130 @@
+/* -------------------------------------------------------------------------
+ *
+ * detector.c
+ *
+ * Phi accrual failure detector for pg_keeper.
+ *
+ * Rather than declaring a node failed after a fixed number of failed polling,
+ * the detector keeps a sliding window of inter-arrival times of heartbeats of
+ * each node and computes a suspicion level phi from the time elapsed since the
+ * last heartbeat, assuming inter-arrival times are normally distributed. phi
+ * of 1 means the chance that we are wrong in suspecting the node is 10%, 2 is
+ * 1%, 3 is 0.1% and so on. See "The phi Accrual Failure Detector" by Hayashibara
+ * et al.
+ *
+ * If pg_keeper.phi_threshold is 0, the node is declared failed after
+ * pg_keeper.keepalives_count failed polling in a row as before.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <math.h>
+
+#include "pg_keeper.h"
+
+/*
+ * Forget the history and regard now as the last heartbeat.
+ */
+void
+resetDetector(KeeperDetector *detector, int64 now)
+{
+	memset(detector, 0, sizeof(KeeperDetector));
+	detector->last_arrival = now;
+}
+
+/*
+ * Record a successful heartbeat at now.
+ */
+void
+detectorHeartbeat(KeeperDetector *detector, int64 now)
+{
+	double interval = (double) (now - detector->last_arrival) / 1000.0;
+
+	/* Evict the oldest interval if the window is full */
+	if (detector->n_intervals == KEEPER_DETECTOR_WINDOW_SIZE)
+	{
+		double oldest = detector->intervals[detector->next_interval];
+
+		detector->sum -= oldest;
+		detector->sum_squares -= oldest * oldest;
+	}
+	else
+		detector->n_intervals++;
+
+	detector->intervals[detector->next_interval] = interval;
+	detector->next_interval = (detector->next_interval + 1) % KEEPER_DETECTOR_WINDOW_SIZE;
+	detector->sum += interval;
+	detector->sum_squares += interval * interval;
+
+	detector->last_arrival = now;
+	detector->misses = 0;
+}
+
+/*
+ * Record a failed polling.
+ */
+void
+detectorMiss(KeeperDetector *detector)
+{
+	detector->misses++;
+}
+
+/*
+ * Return the suspicion level of the node at now.
+ */
+double
+detectorPhi(KeeperDetector *detector, int64 now)
+{
+	double elapsed = (double) (now - detector->last_arrival) / 1000.0;
+	double min_stddev = keeper_keepalives_time / 4.0;
+	double mean;
+	double stddev;
+	double y;
+	double e;
+
+	if (detector->n_intervals == 0)
+	{
+		/* No history yet, assume we got heartbeat at the keepalives time */
+		mean = keeper_keepalives_time;
+		stddev = min_stddev;
+	}
+	else
+	{
+		double variance;
+
+		mean = detector->sum / detector->n_intervals;
+		variance = detector->sum_squares / detector->n_intervals - mean * mean;
+		stddev = sqrt(Max(variance, 0.0));
+	}
+
+	/* Tolerate the pause, and don't be too sensitive on a stable network */
+	mean += keeper_phi_acceptable_pause;
+	stddev = Max(stddev, min_stddev);
+
+	/* Logistic approximation of the cumulative normal distribution */
+	y = (elapsed - mean) / stddev;
+	e = exp(-y * (1.5976 + 0.070566 * y * y));
+
+	if (elapsed > mean)
+		return -log10(e / (1.0 + e));
+	else
+		return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+/*
+ * Return true if the node should be regarded as failed. We never declare the
+ * failure until the polling to the node has actually failed, because phi also
+ * grows while the keeper itself is busy and can't poll.
+ */
+bool
+detectorFailed(KeeperDetector *detector, int64 now)
+{
+	if (detector->misses == 0)
+		return false;
+
+	if (keeper_phi_threshold > 0)
+		return detectorPhi(detector, now) >= keeper_phi_threshold;
+
+	return detector->misses >= keeper_keepalives_count;
+}
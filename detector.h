@@ -0,0 +1,32 @@
+/* -------------------------------------------------------------------------
+ *
+ * detector.h
+ *
+ * Header file for detector.c
+ *
+ * -------------------------------------------------------------------------
+ */
+/* The number of inter-arrival times kept for each node */
+#define KEEPER_DETECTOR_WINDOW_SIZE 64
+
+/*
+ * State of the phi accrual failure detector of one node. The inter-arrival
+ * times of successful heartbeats are kept in a ring buffer in milliseconds.
+ */
+typedef struct KeeperDetector
+{
+	int64	last_arrival;	/* monotonic time of the last heartbeat */
+	int		misses;			/* the number of failed polling in a row */
+	int		n_intervals;	/* the number of valid entries in intervals */
+	int		next_interval;	/* next entry to be overwritten */
+	double	sum;			/* sum of intervals */
+	double	sum_squares;	/* sum of squared intervals */
+	double	intervals[KEEPER_DETECTOR_WINDOW_SIZE];
+} KeeperDetector;
+
+/* Function prototypes */
+extern void resetDetector(KeeperDetector *detector, int64 now);
+extern void detectorHeartbeat(KeeperDetector *detector, int64 now);
+extern void detectorMiss(KeeperDetector *detector);
+extern double detectorPhi(KeeperDetector *detector, int64 now);
+extern bool detectorFailed(KeeperDetector *detector, int64 now);
@@ -0,0 +1,324 @@
+/* -------------------------------------------------------------------------
+ *
+ * gossip.c
+ *
+ * Gossip-based dissemination of membership for pg_keeper.
+ *
+ * The membership, that is the contents of KeeperRepNodes, carries a version,
+ * which is the generation of the management table it was read from. The master
+ * server bumps the generation at each modification of the table, and it's
+ * replicated along with the table, so the version keeps growing across
+ * failover without relying on the clock of any server. Every keeper piggybacks its version on the
+ * heartbeats it sends by calling pgkeeper.gossip(), which tells the peer our
+ * version and returns the peer's one. If the peer has newer membership than
+ * ours, we pull it by pgkeeper.membership() from the peer. If ours is newer,
+ * the keeper of the peer pulls it from us at its next polling.
+ *
+ * A keeper which sent no heartbeat in a polling, for example because the
+ * replication activity stands in for the heartbeats, exchanges the version
+ * with one randomly chosen node instead. So a change of membership spreads to
+ * every keeper in O(log N) pollings without dedicated fan-out.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pg_keeper.h"
+#include "heartbeat.h"
+#include "util.h"
+
+#include "utils/builtins.h"
+#include "utils/int8.h"
+#include "utils/memutils.h"
+
+/* Version of the membership in KeeperRepNodes */
+int64	KeeperMembershipVersion = 0;
+
+/* The newest membership we learned in this polling, and who has it */
+static int64 pull_version = 0;
+static char pull_source[NAMEDATALEN];
+
+/* Did we exchange the version with anyone in this polling? */
+static bool gossiped = false;
+
+/*
+ * Gossip SQLs made for the current membership version and our name, so that
+ * the polling doesn't format them each time. See getGossipSQL().
+ */
+#define GOSSIP_SQL_SLOTS 2
+typedef struct GossipSQL
+{
+	const char *fmt;
+	int64 version;
+	char name[NAMEDATALEN];
+	char *sql;				/* allocated in TopMemoryContext */
+} GossipSQL;
+
+static GossipSQL gossip_sqls[GOSSIP_SQL_SLOTS];
+
+static KeeperNode *chooseGossipPeer(void);
+static bool pullMembership(KeeperNode *source, int64 deadline);
+
+/*
+ * Return the SQL which calls pgkeeper.gossip() with our version, made from fmt
+ * having one %s for the function call. The SQL is made once per membership
+ * version and kept, so caller must not free it.
+ */
+const char *
+getGossipSQL(const char *fmt)
+{
+	GossipSQL *slot = NULL;
+	MemoryContext oldcxt;
+	char *quoted;
+	char *call;
+	int i;
+
+	for (i = 0; i < GOSSIP_SQL_SLOTS; i++)
+	{
+		if (gossip_sqls[i].fmt == NULL || strcmp(gossip_sqls[i].fmt, fmt) == 0)
+		{
+			slot = &(gossip_sqls[i]);
+			break;
+		}
+	}
+
+	if (slot == NULL)
+		elog(ERROR, "too many kinds of gossip SQL");
+
+	if (slot->sql != NULL &&
+		slot->version == KeeperMembershipVersion &&
+		strcmp(slot->name, keeper_node_name) == 0)
+		return slot->sql;
+
+	if (slot->sql != NULL)
+		pfree(slot->sql);
+
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+	quoted = quote_literal_cstr(keeper_node_name);
+	call = psprintf("pgkeeper.gossip(" INT64_FORMAT ", %s)",
+					KeeperMembershipVersion, quoted);
+	slot->sql = psprintf(fmt, call);
+	pfree(call);
+	pfree(quoted);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	slot->fmt = fmt;
+	slot->version = KeeperMembershipVersion;
+	strlcpy(slot->name, keeper_node_name, NAMEDATALEN);
+
+	return slot->sql;
+}
+
+/*
+ * Receive the membership version of node from the given column of the result
+ * of gossip SQL. If it's newer than ours, we will pull it at gossipTick().
+ */
+void
+gossipReceive(KeeperNode *node, PGresult *res, int column)
+{
+	int64 version;
+
+	gossiped = true;
+
+	if (PQntuples(res) == 0 || PQnfields(res) <= column ||
+		PQgetisnull(res, 0, column))
+		return;
+
+	if (!scanint8(PQgetvalue(res, 0, column), true, &version))
+		return;
+
+	if (version > KeeperMembershipVersion && version > pull_version)
+	{
+		pull_version = version;
+		strlcpy(pull_source, node->name, NAMEDATALEN);
+	}
+}
+
+/*
+ * Do the gossip of this polling, called once per polling after heartbeats.
+ * Exchange the version with random node if no heartbeat carried it, then pull
+ * the newest membership we learned if any. All of them share one deadline,
+ * which is the next scheduled polling, so that an unreachable peer delays
+ * neither the keeper nor the heartbeats. Whatever doesn't fit in is left to the
+ * next tick.
+ */
+void
+gossipTick(void)
+{
+	char source[NAMEDATALEN];
+	int64 version;
+	int64 deadline;
+
+	deadline = Min(getMonotonicTime() + keeper_keepalives_time * 1000L,
+				   nextProbeDeadline());
+
+	if (!gossiped && getTimeoutUntil(deadline) > 0)
+	{
+		KeeperNode *peer = chooseGossipPeer();
+
+		if (peer != NULL)
+		{
+			KeeperProbe probe;
+
+			probe.node = peer;
+			probe.sql = getGossipSQL(KEEPER_SQL_GOSSIP);
+			probe.keep_result = true;
+
+			if (probeNodes(&probe, 1, getTimeoutUntil(deadline)) &&
+				probe.status == PROBE_DONE)
+				gossipReceive(peer, probe.res, 0);
+
+			if (probe.res != NULL)
+				PQclear(probe.res);
+		}
+	}
+	gossiped = false;
+
+	/* Other keepers may have told us that they have newer membership */
+	version = takeGossip(source);
+	if (version > KeeperMembershipVersion && version > pull_version)
+	{
+		pull_version = version;
+		strlcpy(pull_source, source, NAMEDATALEN);
+	}
+
+	/*
+	 * The master server never pulls the membership, because its management
+	 * table is authoritative.
+	 */
+	if (pull_version > KeeperMembershipVersion && RecoveryInProgress())
+	{
+		KeeperNode *node = findNodeByName(pull_source);
+
+		/*
+		 * We may not know the node telling us yet, for example new node. The
+		 * master server must have the newest membership anyway.
+		 */
+		if (node == NULL || !pullMembership(node, deadline))
+		{
+			int i;
+
+			for (i = 0; i < nKeeperRepNodes; i++)
+			{
+				if (KeeperRepNodes[i].is_master && &(KeeperRepNodes[i]) != node)
+				{
+					pullMembership(&(KeeperRepNodes[i]), deadline);
+					break;
+				}
+			}
+		}
+	}
+
+	pull_version = 0;
+}
+
+/*
+ * Choose one node other than ourselves at random. Return NULL if none.
+ */
+static KeeperNode *
+chooseGossipPeer(void)
+{
+	int ncandidates = 0;
+	int chosen;
+	int i;
+
+	for (i = 0; i < nKeeperRepNodes; i++)
+	{
+		if (pg_strcasecmp(KeeperRepNodes[i].name, keeper_node_name) != 0)
+			ncandidates++;
+	}
+
+	if (ncandidates == 0)
+		return NULL;
+
+	chosen = (int) (random() % ncandidates);
+
+	for (i = 0; i < nKeeperRepNodes; i++)
+	{
+		if (pg_strcasecmp(KeeperRepNodes[i].name, keeper_node_name) == 0)
+			continue;
+
+		if (chosen-- == 0)
+			return &(KeeperRepNodes[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Pull the membership from source and replace our cache with it, if it's newer
+ * than ours. Return false if we could not pull it by deadline.
+ */
+static bool
+pullMembership(KeeperNode *source, int64 deadline)
+{
+#define KEEPER_SQL_MEMBERSHIP "SELECT version, seqno, name, conninfo, is_master FROM pgkeeper.membership() ORDER BY seqno"
+	KeeperProbe probe;
+	PGresult *res;
+	KeeperNode *nodes;
+	MemoryContext cxt;
+	int64 version;
+	int64 now;
+	long timeout;
+	int num;
+	int i;
+
+	if ((timeout = getTimeoutUntil(deadline)) <= 0)
+		return false;
+
+	probe.node = source;
+	probe.sql = KEEPER_SQL_MEMBERSHIP;
+	probe.keep_result = true;
+
+	if (!probeNodes(&probe, 1, timeout) || probe.status != PROBE_DONE)
+	{
+		if (probe.res != NULL)
+			PQclear(probe.res);
+		return false;
+	}
+
+	res = probe.res;
+	now = getMonotonicTime();
+
+	num = PQntuples(res);
+
+	/* The source might have just started and know nothing yet */
+	if (num == 0 ||
+		!scanint8(PQgetvalue(res, 0, 0), true, &version) ||
+		version <= KeeperMembershipVersion)
+	{
+		PQclear(res);
+		return false;
+	}
+
+	cxt = createCacheContext();
+	nodes = MemoryContextAlloc(cxt, sizeof(KeeperNode) * num);
+
+	for (i = 0; i < num; i++)
+	{
+		nodes[i].seqno = atoi(PQgetvalue(res, i, 1));
+		nodes[i].name = MemoryContextStrdup(cxt, PQgetvalue(res, i, 2));
+		nodes[i].conninfo = MemoryContextStrdup(cxt, PQgetvalue(res, i, 3));
+		nodes[i].is_master = str_to_bool(PQgetvalue(res, i, 4));
+		initNodeState(&(nodes[i]), now);
+	}
+
+	PQclear(res);
+
+	ereport(LOG,
+			(errmsg("pg_keeper pulls membership version " INT64_FORMAT " from \"%s\"",
+					version, source->name)));
+
+	/*
+	 * source may be freed by installing new cache. Our cache no longer
+	 * corresponds to our replica of the management table, which is read again
+	 * once its generation reaches the version. See updateLocalCache().
+	 */
+	KeeperMembershipVersion = version;
+	KeeperNodeInfoGeneration = -1;
+	installLocalCache(cxt, nodes, num);
+
+	return true;
+}
@@ -0,0 +1,545 @@
+/* -------------------------------------------------------------------------
+ *
+ * heartbeat.c
+ *
+ * Heartbeat connection pool for pg_keeper.
+ *
+ * The keeper process keeps one long-lived libpq connection per node in
+ * KeeperRepNodes and reuses it for every heartbeat, rather than doing a full
+ * connection startup (and a backend fork on the peer) for each polling.
+ * Connections are handed over to the new cache when updateLocalCache()
+ * rebuilds KeeperRepNodes, and are re-established only when broken.
+ *
+ * probeNodes() polls the multiple nodes concurrently using non-blocking libpq
+ * and one WaitEventSet, so that a slow or unreachable node doesn't delay the
+ * polling to other nodes. The duration of one polling is bounded by the given
+ * timeout, rather than the sum of each round trip and connection timeout.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pg_keeper.h"
+#include "heartbeat.h"
+#include "util.h"
+
+#include "libpq-int.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+
+/* Buffers for polling sized for KeeperRepNodes, see allocProbeBuffers() */
+KeeperProbe *KeeperProbeBuffer = NULL;
+KeeperNode **KeeperCandidateBuffer = NULL;
+static WaitEvent *KeeperWaitEventBuffer = NULL;
+static int n_wait_events = 0;
+
+static PGconn *connectNode(KeeperNode *node);
+static void startProbe(KeeperProbe *probe);
+static void sendProbeQuery(KeeperProbe *probe);
+static void advanceProbe(KeeperProbe *probe);
+static void failProbe(KeeperProbe *probe, const char *reason);
+static void discardLateResult(PGconn *con);
+static int	probeWaitEvents(KeeperProbe *probe);
+
+/*
+ * Start connecting to given node without blocking.
+ *
+ * TCP keepalives are enabled on the pooled connections, so that a connection
+ * whose peer silently went away is found broken while it's idle rather than
+ * on the next polling. They precede the conninfo of the node, which may
+ * override them. The connection attempt itself is bounded by the deadline of
+ * probeNodes(), as libpq doesn't enforce connect_timeout on non-blocking
+ * connection.
+ */
+static PGconn *
+connectNode(KeeperNode *node)
+{
+	const char *keywords[6];
+	const char *values[6];
+	char idle[16];
+	char count[16];
+
+	snprintf(idle, sizeof(idle), "%d", Max(keeper_keepalives_time / 1000, 1));
+	snprintf(count, sizeof(count), "%d", Max(keeper_keepalives_count, 1));
+
+	keywords[0] = "keepalives";
+	values[0] = "1";
+	keywords[1] = "keepalives_idle";
+	values[1] = idle;
+	keywords[2] = "keepalives_interval";
+	values[2] = idle;
+	keywords[3] = "keepalives_count";
+	values[3] = count;
+	keywords[4] = "dbname";
+	values[4] = node->conninfo;
+	keywords[5] = NULL;
+	values[5] = NULL;
+
+	return PQconnectStartParams(keywords, values, 1);
+}
+
+/*
+ * Close the pooled connection of given node.
+ */
+void
+closeNodeConnection(KeeperNode *node)
+{
+	if (node->conn == NULL)
+		return;
+
+	PQfinish(node->conn);
+	node->conn = NULL;
+}
+
+/*
+ * Hand over the pooled connections, the failure detector, the replication
+ * activity, the polling result and its schedule from old node cache to new one.
+ * They are inherited only if the node having exactly same name and conninfo
+ * exists in new cache, otherwise the connection is closed. The new nodes must
+ * be indexed already, see buildNodeIndex().
+ */
+void
+inheritNodeState(KeeperNode *oldnodes, int n_oldnodes)
+{
+	int i;
+
+	for (i = 0; i < n_oldnodes; i++)
+	{
+		KeeperNode *old = &(oldnodes[i]);
+		KeeperNode *new = findNodeByName(old->name);
+
+		/*
+		 * The index matches names case-insensitively, but node_info may have
+		 * names differing only in case, which must not share one new node.
+		 */
+		if (new != NULL && strcmp(old->name, new->name) == 0 &&
+			strcmp(old->conninfo, new->conninfo) == 0)
+		{
+			/* Don't leak the connection if a duplicate name inherited first */
+			closeNodeConnection(new);
+
+			new->conn = old->conn;
+			new->detector = old->detector;
+			new->stream_write = old->stream_write;
+			new->stream_flush = old->stream_flush;
+			new->stream_progress = old->stream_progress;
+			new->stream_alive = old->stream_alive;
+			new->reachable = old->reachable;
+			new->last_probe = old->last_probe;
+			new->last_seen = old->last_seen;
+			new->rtt = old->rtt;
+			new->next_probe = old->next_probe;
+			new->probe_lateness = old->probe_lateness;
+			old->conn = NULL;
+		}
+
+		/* The node was removed or changed its conninfo */
+		closeNodeConnection(old);
+	}
+}
+
+/*
+ * Allocate the buffers for polling to num nodes in cxt, which is the memory
+ * context of new node cache, so that the polling doesn't allocate them at each
+ * time. They are freed along with the cache.
+ */
+void
+allocProbeBuffers(MemoryContext cxt, int num)
+{
+	KeeperProbeBuffer = MemoryContextAlloc(cxt, sizeof(KeeperProbe) * Max(num, 1));
+	KeeperCandidateBuffer = MemoryContextAlloc(cxt, sizeof(KeeperNode *) * Max(num, 1));
+	KeeperWaitEventBuffer = MemoryContextAlloc(cxt, sizeof(WaitEvent) * (num + 2));
+	n_wait_events = num + 2;
+}
+
+/*
+ * probeNodes()
+ *
+ * Execute SQL of each probe on its node concurrently, and wait for all of them
+ * up to timeout milliseconds. The probes not completed within timeout are
+ * regarded as failed. Return false if we were interrupted by SIGTERM, in which
+ * case the caller should not make any decision from the result.
+ */
+bool
+probeNodes(KeeperProbe *probes, int nprobes, long timeout)
+{
+	int64		deadline;
+	WaitEvent	*occurred;
+	WaitEventSet *set = NULL;
+	bool		latch_set = false;
+	int			i;
+
+	deadline = getMonotonicTime() + timeout * 1000L;
+
+	/* Use the buffer for KeeperRepNodes unless probing more than them */
+	if (nprobes + 2 <= n_wait_events)
+		occurred = KeeperWaitEventBuffer;
+	else
+		occurred = palloc(sizeof(WaitEvent) * (nprobes + 2));
+
+	for (i = 0; i < nprobes; i++)
+	{
+		probes[i].start = getMonotonicTime();
+		startProbe(&(probes[i]));
+	}
+
+	while (!got_sigterm)
+	{
+		long		remaining;
+		int			n_inflight = 0;
+		int			nevents;
+		bool		rebuild = (set == NULL);
+
+		/*
+		 * The wait event set is kept across the waits, and rebuilt only when
+		 * the sockets may change, that is a probe started new connection or
+		 * finished. A finished probe must be removed since its socket may stay
+		 * readable or be closed, but the wait event set can't remove a socket.
+		 * PQconnectPoll() may also close the socket and open another one, for
+		 * the next address of the host or to retry without SSL, possibly with
+		 * the same descriptor number. So we rebuild while any probe is still
+		 * connecting, which lasts only a few round trips.
+		 */
+		for (i = 0; i < nprobes; i++)
+		{
+			if (probes[i].status < PROBE_DONE)
+			{
+				n_inflight++;
+				if (probes[i].event_pos < 0 ||
+					probes[i].status == PROBE_CONNECTING)
+					rebuild = true;
+			}
+			else if (probes[i].event_pos >= 0)
+				rebuild = true;
+		}
+
+		/* All probes have been completed */
+		if (n_inflight == 0)
+			break;
+
+		remaining = getTimeoutUntil(deadline);
+		if (remaining <= 0)
+		{
+			for (i = 0; i < nprobes; i++)
+			{
+				if (probes[i].status == PROBE_WAITING)
+				{
+					/*
+					 * The query has been sent, so keep the connection. If the
+					 * reply just came late, startProbe() takes it and the next
+					 * polling doesn't need new connection.
+					 */
+					if (probes[i].res != NULL)
+					{
+						PQclear(probes[i].res);
+						probes[i].res = NULL;
+					}
+					ereport(LOG,
+							(errmsg("timed out : \"%s\"",
+									probes[i].node->conninfo)));
+					probes[i].status = PROBE_FAILED;
+				}
+				else if (probes[i].status < PROBE_DONE)
+				{
+					/* Don't retry on new connection, the time is up */
+					probes[i].reused = false;
+					failProbe(&(probes[i]), "timed out");
+				}
+			}
+			break;
+		}
+
+		if (rebuild)
+		{
+			if (set != NULL)
+				FreeWaitEventSet(set);
+
+			set = CreateWaitEventSet(CurrentMemoryContext, n_inflight + 2);
+			AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET,
+							  &MyProc->procLatch, NULL);
+			AddWaitEventToSet(set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET,
+							  NULL, NULL);
+		}
+
+		for (i = 0; i < nprobes; i++)
+		{
+			KeeperProbe *probe = &(probes[i]);
+			int events;
+
+			if (probe->status >= PROBE_DONE)
+			{
+				probe->event_pos = -1;
+				continue;
+			}
+
+			events = probeWaitEvents(probe);
+
+			if (rebuild)
+			{
+				probe->event_pos = AddWaitEventToSet(set, events,
+													 PQsocket(probe->node->conn),
+													 NULL, probe);
+				probe->event_mask = events;
+			}
+			else if (events != probe->event_mask)
+			{
+				ModifyWaitEvent(set, probe->event_pos, events, NULL);
+				probe->event_mask = events;
+			}
+		}
+
+		nevents = WaitEventSetWait(set, remaining,
+								   occurred, n_inflight + 2);
+
+		for (i = 0; i < nevents; i++)
+		{
+			WaitEvent *event = &(occurred[i]);
+
+			/* Emergency bailout if postmaster has died */
+			if (event->events & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			if (event->events & WL_LATCH_SET)
+			{
+				ResetLatch(&MyProc->procLatch);
+				latch_set = true;
+				continue;
+			}
+
+			advanceProbe((KeeperProbe *) event->user_data);
+		}
+	}
+
+	if (set != NULL)
+		FreeWaitEventSet(set);
+
+	if (occurred != KeeperWaitEventBuffer)
+		pfree(occurred);
+
+	/*
+	 * We consumed the latch while polling, set it again so that the main
+	 * loop can handle the signals promptly.
+	 */
+	if (latch_set)
+		SetLatch(&MyProc->procLatch);
+
+	return !got_sigterm;
+}
+
+/*
+ * Start the probe, using pooled connection if available.
+ */
+static void
+startProbe(KeeperProbe *probe)
+{
+	KeeperNode *node = probe->node;
+
+	probe->got_result = false;
+	probe->res = NULL;
+
+	/* Not waited for yet, possibly on new socket */
+	probe->event_pos = -1;
+
+	/* The previous polling timed out, take its reply if arrived since then */
+	if (node->conn != NULL && PQstatus(node->conn) == CONNECTION_OK &&
+		PQtransactionStatus(node->conn) == PQTRANS_ACTIVE)
+		discardLateResult(node->conn);
+
+	if (node->conn != NULL && PQstatus(node->conn) == CONNECTION_OK &&
+		PQtransactionStatus(node->conn) == PQTRANS_IDLE)
+	{
+		probe->reused = true;
+		sendProbeQuery(probe);
+		return;
+	}
+
+	probe->reused = false;
+	closeNodeConnection(node);
+
+	node->conn = connectNode(node);
+	if (node->conn == NULL || PQstatus(node->conn) == CONNECTION_BAD)
+	{
+		failProbe(probe, "could not establish conenction to server");
+		return;
+	}
+
+	/* We must behave as if PQconnectPoll returned PGRES_POLLING_WRITING */
+	probe->status = PROBE_CONNECTING;
+	probe->pollstatus = PGRES_POLLING_WRITING;
+}
+
+/*
+ * Dispatch the SQL of probe on the established connection.
+ */
+static void
+sendProbeQuery(KeeperProbe *probe)
+{
+	PGconn *con = probe->node->conn;
+
+	if (PQsetnonblocking(con, 1) != 0 || !PQsendQuery(con, probe->sql))
+	{
+		failProbe(probe, "could not send query to server");
+		return;
+	}
+
+	probe->status = PROBE_SENDING;
+	advanceProbe(probe);
+}
+
+/*
+ * Advance the state of probe as far as possible without blocking.
+ */
+static void
+advanceProbe(KeeperProbe *probe)
+{
+	PGconn *con = probe->node->conn;
+
+	switch (probe->status)
+	{
+		case PROBE_CONNECTING:
+			probe->pollstatus = PQconnectPoll(con);
+
+			if (probe->pollstatus == PGRES_POLLING_FAILED)
+				failProbe(probe, "could not establish conenction to server");
+			else if (probe->pollstatus == PGRES_POLLING_OK)
+				sendProbeQuery(probe);
+			break;
+
+		case PROBE_SENDING:
+			{
+				int ret = PQflush(con);
+
+				if (ret < 0)
+					failProbe(probe, "could not send query to server");
+				else if (ret == 0)
+				{
+					probe->status = PROBE_WAITING;
+					advanceProbe(probe);
+				}
+			}
+			break;
+
+		case PROBE_WAITING:
+			for (;;)
+			{
+				PGresult *res;
+
+				if (!PQconsumeInput(con))
+				{
+					failProbe(probe, "could not get tuple from server");
+					break;
+				}
+
+				/* Wait for more data */
+				if (PQisBusy(con))
+					break;
+
+				/* Got the all results */
+				if ((res = PQgetResult(con)) == NULL)
+				{
+					if (probe->got_result)
+					{
+						/* The server is alive now */
+						probe->status = PROBE_DONE;
+						probe->rtt = getMonotonicTime() - probe->start;
+					}
+					else
+						failProbe(probe, "could not get tuple from server");
+					break;
+				}
+
+				/* We are interested in only the first result */
+				if (!probe->got_result)
+				{
+					if (PQresultStatus(res) != PGRES_TUPLES_OK &&
+						PQresultStatus(res) != PGRES_COMMAND_OK)
+					{
+						PQclear(res);
+						failProbe(probe, "could not get tuple from server");
+						break;
+					}
+
+					if (PQntuples(res) > 0 && PQnfields(res) > 0)
+						probe->result = str_to_bool(PQgetvalue(res, 0, 0));
+					probe->got_result = true;
+
+					if (probe->keep_result)
+					{
+						probe->res = res;
+						continue;
+					}
+				}
+
+				PQclear(res);
+			}
+			break;
+
+		case PROBE_DONE:
+		case PROBE_FAILED:
+			break;
+	}
+}
+
+/*
+ * Handle the failure of probe. If the probe was started on the pooled
+ * connection, retry once on new connection so that a connection broken since
+ * the last polling, for example by restart of the server, isn't counted as a
+ * failure of polling.
+ */
+static void
+failProbe(KeeperProbe *probe, const char *reason)
+{
+	if (probe->res != NULL)
+	{
+		PQclear(probe->res);
+		probe->res = NULL;
+	}
+
+	closeNodeConnection(probe->node);
+
+	if (probe->reused)
+	{
+		startProbe(probe);
+		return;
+	}
+
+	ereport(LOG,
+			(errmsg("%s : \"%s\"", reason, probe->node->conninfo)));
+
+	probe->status = PROBE_FAILED;
+}
+
+/*
+ * Consume the results of the query left on the connection, if all of them have
+ * arrived. Otherwise the connection stays busy, and the caller reconnects.
+ */
+static void
+discardLateResult(PGconn *con)
+{
+	PGresult *res;
+
+	if (!PQconsumeInput(con))
+		return;
+
+	while (!PQisBusy(con) && (res = PQgetResult(con)) != NULL)
+		PQclear(res);
+}
+
+/*
+ * Return the socket events the probe is waiting for.
+ */
+static int
+probeWaitEvents(KeeperProbe *probe)
+{
+	switch (probe->status)
+	{
+		case PROBE_CONNECTING:
+			return (probe->pollstatus == PGRES_POLLING_READING) ?
+				WL_SOCKET_READABLE : WL_SOCKET_WRITEABLE;
+		case PROBE_SENDING:
+			/* The server might send something before accepting our query */
+			return WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE;
+		default:
+			return WL_SOCKET_READABLE;
+	}
+}
@@ -0,0 +1,49 @@
+/* -------------------------------------------------------------------------
+ *
+ * heartbeat.h
+ *
+ * Header file for heartbeat.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+/* Status of asynchronous probe */
+typedef enum KeeperProbeStatus
+{
+	PROBE_CONNECTING = 0,	/* establishing connection */
+	PROBE_SENDING,			/* flushing the query to the server */
+	PROBE_WAITING,			/* waiting for the result */
+	PROBE_DONE,				/* got the result successfully */
+	PROBE_FAILED			/* failed or timed out */
+} KeeperProbeStatus;
+
+/*
+ * A probe executes one SQL on one node. Caller fills node, sql and keep_result,
+ * and probeNodes() fills the rest.
+ */
+typedef struct KeeperProbe
+{
+	KeeperNode	*node;
+	const char	*sql;
+	bool		keep_result;	/* keep the first result in res? */
+	KeeperProbeStatus status;
+	PostgresPollingStatusType pollstatus;	/* last result of PQconnectPoll */
+	bool		reused;		/* started on the pooled connection? */
+	bool		got_result;	/* received the first result? */
+	int			event_pos;	/* position in the wait event set, -1 if not in it */
+	int			event_mask;	/* events we are waiting for at event_pos */
+	int64		start;		/* monotonic time when the probe started */
+	int64		rtt;		/* round trip time in microseconds */
+	PGresult	*res;		/* the first result if keep_result, caller must PQclear */
+	bool		result;		/* first column of result, if any */
+} KeeperProbe;
+
+extern KeeperProbe *KeeperProbeBuffer;
+extern KeeperNode **KeeperCandidateBuffer;
+
+/* Function prototypes */
+extern void allocProbeBuffers(MemoryContext cxt, int num);
+extern bool probeNodes(KeeperProbe *probes, int nprobes, long timeout);
+extern void closeNodeConnection(KeeperNode *node);
+extern void inheritNodeState(KeeperNode *oldnodes, int n_oldnodes);
@@ -10,6 +10,7 @@
 #include "postgres.h"
 
 #include "pg_keeper.h"
+#include "heartbeat.h"
 #include "syncrep.h"
 #include "util.h"
 
@@ -31,6 +32,7 @@
 #include "libpq-int.h"
 #include "tcop/utility.h"
 #include "utils/snapmgr.h"
+#include "utils/memutils.h"
 #include "utils/ps_status.h"
 
 #define ALTER_SYSTEM_COMMAND "ALTER SYSTEM SET synchronous_standby_names TO '';"
@@ -40,13 +42,10 @@ bool	KeeperMainMaster(void);
 void	setupKeeperMaster(void);
 
 static void changeToAsync(void);
-static bool heartbeatServerMaster(int *r_counts);
+static bool heartbeatServerMaster(KeeperNode **due, int ndue);
 static bool deleteMaster(void);
 static bool updateNewMaster(void);
 
-/* Variables for heartbeat */
-static int *retry_counts;
-
 /*
  * Set up several parameters for master mode.
  */
@@ -59,8 +58,7 @@ setupKeeperMaster()
 	/* Update own cache if pg_keeper is already installed */
 	if (checkExtensionInstalled())
 	{
-		updateLocalCache(false);
-		retry_counts = resetRetryCounts(retry_counts);
+		updateLocalCache();
 	}
 }
 
@@ -70,55 +68,97 @@ setupKeeperMaster()
 bool
 KeeperMainMaster(void)
 {
+	int64	next_polling = getMonotonicTime();
+
 	/*
 	 * Main loop: do this until the SIGTERM handler tells us to terminate
 	 */
 	while (!got_sigterm)
 	{
 		int		rc;
+		int64	now;
+		KeeperCommandSet commands;
+		KeeperNode **due;
+		int		ndue;
+		bool	polling;
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
 		 * instead, they may wait on their process latch, which sleeps as
 		 * necessary, but is awakened if postmaster dies.  That way the
 		 * background process goes away immediately in an emergency.
+		 * We sleep until the next polling time or the nearest deadline of
+		 * polling to a node, so that the interval of polling doesn't include
+		 * the time spent for polling itself.
 		 */
 		rc = WaitLatch(&MyProc->procLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   keeper_keepalives_time * 1000L);
+					   getTimeoutUntil(Min(next_polling, nextProbeDeadline())));
 		ResetLatch(&MyProc->procLatch);
 
+		/* Free everything the last tick allocated */
+		MemoryContextReset(KeeperTickContext);
+		MemoryContextSwitchTo(KeeperTickContext);
+
 		/* Emergency bailout if postmaster has died */
 		if (rc & WL_POSTMASTER_DEATH)
 			return false;
 
-		/* If got SIGHUP, reload the configuration file */
-		if (got_sighup)
+		/* Receive the commands from backends at once */
+		receiveKeeperCommands(&commands);
+
+		/* If got SIGHUP or asked, reload the configuration file */
+		if (got_sighup || commands.reload_config)
 		{
 			got_sighup = false;
 			ProcessConfigFile(PGC_SIGHUP);
 			parse_synchronous_standby_names();
-			updateManageTableAccordingToSSNames(true);
+
+			/* The roles of nodes are determined by us, tell standbys the next master */
+			updateNodeRoles(KeeperRepNodes, nKeeperRepNodes);
+			storeNextMaster();
+			buildProbeSchedule();
+			publishClusterState();
 		}
 
-		/* If got SIGUSR1, update local cache for KeeperRepNodes */
-		if (got_sigusr1)
+		/*
+		 * If got commands from backends or SIGUSR1, update local cache for
+		 * KeeperRepNodes. The commands are sent after the modification is
+		 * committed, so we don't need to wait for it.
+		 */
+		if (commands.reload_nodes || got_sigusr1)
 		{
 			got_sigusr1 = false;
-			pg_usleep(1 * 1000L * 1000L);
 
-			/* Update own memory and send SIGUSR1 of other standbys indirectly */
-			updateLocalCache(true);
+			/* Update own memory, other keepers learn the change by gossip */
+			updateLocalCache();
+		}
 
-			/* Update retry_counts information */
-			retry_counts = resetRetryCounts(retry_counts);
+		/* Start polling immediately if asked */
+		if (commands.force_probe)
+		{
+			next_polling = getMonotonicTime();
+			expediteProbes(next_polling);
 		}
 
+		/*
+		 * If we were woken up by the latch before the next polling time and
+		 * no node is due, go back to sleep. Both are advanced on fixed rate.
+		 */
+		now = getMonotonicTime();
+		ndue = takeDueProbes(now, &due);
+		polling = (now >= next_polling);
+		if (!polling && ndue == 0)
+			continue;
+		if (polling)
+			next_polling = nextFixedDeadline(next_polling,
+											 keeper_keepalives_time * 1000L, now);
+
 		/*
 		 * We get started pooling to synchronous standby server
 		 * after a standby server connected to master server.
 		 */
-		if (current_status == KEEPER_MASTER_READY)
+		if (current_status == KEEPER_MASTER_READY && polling)
 		{
 			int n_in_table = 0;
 			int n_connect_standbys;
@@ -137,19 +177,20 @@ KeeperMainMaster(void)
 					deleteMaster();
 					/* Set new master */
 					updateNewMaster();
-					/* Update management table */
-					updateManageTableAccordingToSSNames(false);
 
 					END_SPI_TRANSACTION();
 
 					/* Update local cache */
-					updateLocalCache(false);
+					updateLocalCache();
 
 					promoted = false;
 			}
 
-			/* Check if any standby is already connected */
-			getAllRepNodes(&n_in_table, true);
+			/*
+			 * Check if any standby is already connected. The local cache is
+			 * kept up to date by SIGUSR1, so we don't need to read the table.
+			 */
+			n_in_table = nKeeperRepNodes;
 			n_connect_standbys = getNumberOfConnectingStandbys();
 
 			/*
@@ -159,21 +200,21 @@ KeeperMainMaster(void)
 			if (n_connect_standbys > 0 && (n_connect_standbys + 1) == n_in_table)
 			{
 				current_status = KEEPER_MASTER_CONNECTED;
-				updateLocalCache(false);
+				updateLocalCache();
 				ereport(LOG,
 						(errmsg("pg_keeper connects to standby servers, start monitoring")));
-				retry_counts = resetRetryCounts(retry_counts);
+				resetAllDetectors();
 			}
 		}
-		else if (current_status == KEEPER_MASTER_CONNECTED)
+		else if (current_status == KEEPER_MASTER_CONNECTED && ndue > 0)
 		{
 			/*
-			 * Pooling to standby servers. If we could not pool to standby enough
-			 * to continue synchronous replication at more than keeper_keepalive_count
-			 * counts *in a row*, then change to asynchronous replication using
-			 * ALTER SYSTEM.
+			 * Pooling to the standby servers which are due. If we could not pool
+			 * to standby enough to continue synchronous replication at more than
+			 * keeper_keepalive_count counts *in a row*, then change to
+			 * asynchronous replication using ALTER SYSTEM.
 			 */
-			if (!heartbeatServerMaster(retry_counts))
+			if (!heartbeatServerMaster(due, ndue))
 			{
 				/* Change to asynchronous replication */
 				changeToAsync();
@@ -184,14 +225,25 @@ KeeperMainMaster(void)
 				 */
 				current_status = KEEPER_MASTER_ASYNC;
 
-				updateLocalCache(false);
-				retry_counts = resetRetryCounts(retry_counts);
+				updateLocalCache();
+				resetAllDetectors();
 			}
 		}
 		else if (current_status == KEEPER_MASTER_ASYNC)
 		{
 			/* XXX : Should we continue to pool the all standbys? */
 		}
+
+		/* Spread our membership to other keepers */
+		if (polling)
+			gossipTick();
+
+		/* Poll to the suspected nodes more frequently, or relax it */
+		if (ndue > 0)
+			adaptProbeSchedule();
+
+		/* Publish the result of polling to backends */
+		publishClusterState();
 	}
 
 	return true;
@@ -199,58 +251,122 @@ KeeperMainMaster(void)
 
 /*
  * heartbeatServerMaster()
- * Polling to standby servers. Return false iif we could not poll the standbys enough
- * to continue synchronous replication at more than keeper_keepalive_count *in a row*.
+ * Polling to the standby servers in due. Return false iif we could not poll the
+ * standbys enough to continue synchronous replication, and the failure detector
+ * regards them as failed.
  */
 static bool
-heartbeatServerMaster(int *r_counts)
+heartbeatServerMaster(KeeperNode **due, int ndue)
 {
+	KeeperProbe *probes;
+	int nprobes = 0;
 	int connect_sync = 0;
 	int registered_sync = 0;
 	int i;
+	int64 now;
 	bool connect_enough = true;
 	bool retry_count_reached = false;
+	const char *sql;
 
-	/* Pooling to all nodes listed on KeeperRepNodes */
-	for (i = 0; i < nKeeperRepNodes; i++)
+	/* Sized for KeeperRepNodes when the cache was installed */
+	probes = KeeperProbeBuffer;
+
+	/* Heartbeats carry our membership version */
+	sql = getGossipSQL(KEEPER_SQL_GOSSIP);
+
+	/* Learn which standbys are alive from their replication activity */
+	updateStreamState(getMonotonicTime());
+
+	/* Pooling to the nodes whose deadline has come */
+	for (i = 0; i < ndue; i++)
 	{
-		KeeperNode *node = &(KeeperRepNodes[i]);
-		char *connstr = node->conninfo;
+		KeeperNode *node = due[i];
 
-		/* Not interested in master server */
-		if (node->is_master)
+		/*
+		 * The standby replied to its walsender recently, which is as good as a
+		 * heartbeat. We poll to only the silent standbys.
+		 */
+		if (node->stream_alive)
+		{
+			recordNodeHeartbeat(node, getMonotonicTime());
+			recordNodeObservation(node, true, -1);
 			continue;
+		}
 
-		/* Not insterested in async standby server as well */
-		if (!node->is_sync)
-			continue;
+		probes[nprobes].node = node;
+		probes[nprobes].sql = sql;
+		probes[nprobes].keep_result = true;
+		nprobes++;
+	}
 
-		/* Count registred sync node */
-		registered_sync++;
+	/*
+	 * Poll to the due standbys at once. Each polling must be done within
+	 * keepalives time so that a black-holed standby can't delay next polling.
+	 * The shorter interval of a suspected standby only advances its schedule,
+	 * since a reply slower than that interval doesn't mean the standby is
+	 * down.
+	 */
+	if (!probeNodes(probes, nprobes, keeper_keepalives_time))
+	{
+		/* Interrupted by SIGTERM, don't make any decision */
+		for (i = 0; i < nprobes; i++)
+		{
+			if (probes[i].res != NULL)
+				PQclear(probes[i].res);
+		}
+		return true;
+	}
 
-		if (!(heartbeatServer(connstr)))
+	now = getMonotonicTime();
+
+	for (i = 0; i < nprobes; i++)
+	{
+		KeeperNode *node = probes[i].node;
+		KeeperDetector *detector = &(node->detector);
+
+		if (probes[i].status != PROBE_DONE)
 		{
-			/* Increment retry count of this node */
-			(r_counts[i])++;
+			/* Record the failure of this node */
+			recordNodeMiss(node);
+			recordNodeObservation(node, false, -1);
 
 			/* Emit warning log */
 			ereport(WARNING,
-					(errmsg("pg_keeper failed to poll to \"%s\" at %d time(s)",
-							connstr, r_counts[i])));
+					(errmsg("pg_keeper failed to poll to \"%s\" at %d time(s), phi %.2f",
+							node->conninfo, detector->misses,
+							detectorPhi(detector, now))));
+			continue;
+		}
 
-			/* Check if we could not connect to "sync" standby */
-			if (r_counts[i] > keeper_keepalives_count)
-				retry_count_reached = true;
+		/* Success polling, record the heartbeat */
+		recordNodeHeartbeat(node, now);
+		recordNodeObservation(node, true, probes[i].rtt);
+		gossipReceive(node, probes[i].res, 0);
+		PQclear(probes[i].res);
+	}
+
+	/*
+	 * The sync standbys are polled on their own schedule, so make a decision
+	 * from the last polling result of each of them.
+	 */
+	for (i = 0; i < nKeeperRepNodes; i++)
+	{
+		KeeperNode *node = &(KeeperRepNodes[i]);
 
+		/* Not interested in master server and async standby server */
+		if (node->is_master || !node->is_sync)
 			continue;
-		}
 
-		/* Success polling, reset retry_counts */
-		r_counts[i] = 0;
+		/* Count registred sync node */
+		registered_sync++;
 
 		/* Keep track of the number of sync standby */
-		if (node->is_sync)
+		if (node->reachable)
 			connect_sync++;
+
+		/* Check if we could not connect to "sync" standby */
+		if (detectorFailed(&(node->detector), now))
+			retry_count_reached = true;
 	}
 
 	/*
@@ -294,30 +410,35 @@ changeToAsync(void)
 static bool
 deleteMaster(void)
 {
-#define KEEPER_SQL_DELETE_MASTER "DELETE FROM %s WHERE is_master"
-	StringInfoData sql;
 	bool ret;
 
-	initStringInfo(&sql);
-	appendStringInfo(&sql, KEEPER_SQL_DELETE_MASTER, KEEPER_MANAGE_TABLE_NAME);
-	ret = spiSQLExec(sql.data, false);
+	ret = execKeeperPlan(KEEPER_PLAN_DELETE_MASTER, NULL, false);
+
+	/* Deleted rows are noticed by the new generation */
+	if (ret && SPI_processed > 0)
+		getNodeInfoGeneration();
 
 	return ret;
 }
 
 /*
- * Set the standby node marked is_nextmaster to new master server.
+ * Set ourselves, promoted as the next master, to new master server. We no
+ * longer follow the next master stored by the old master, and our own
+ * decision is made from the updated table.
  */
 static bool
 updateNewMaster(void)
 {
-#define KEEPER_SQL_UPDATE_NEW_MASTER "UPDATE %s SET is_master = true WHERE is_nextmaster"
-	StringInfoData sql;
+	KeeperNode *node = findNodeByName(keeper_node_name);
+	Datum values[2];
 	bool ret;
 
-	initStringInfo(&sql);
-	appendStringInfo(&sql, KEEPER_SQL_UPDATE_NEW_MASTER, KEEPER_MANAGE_TABLE_NAME);
-	ret = spiSQLExec(sql.data, false);
+	if (node == NULL)
+		return false;
+
+	values[0] = Int64GetDatum(getNodeInfoGeneration());
+	values[1] = Int32GetDatum(node->seqno);
+	ret = execKeeperPlan(KEEPER_PLAN_UPDATE_NEW_MASTER, values, false);
 
 	return ret;
 }
@@ -0,0 +1,90 @@
+/* pg_keeper/pg_keeper--2.0--2.1.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_keeper UPDATE TO '2.1'" to load this file. \quit
+
+-- Generation of node management table, incremented by each modification,
+-- and the seqno of the next master decided by the master server
+CREATE TABLE pgkeeper.node_info_generation(
+generation	bigint NOT NULL,
+next_master	integer
+);
+INSERT INTO pgkeeper.node_info_generation
+SELECT 0, min(seqno) FROM pgkeeper.node_info WHERE is_nextmaster;
+
+-- The next master is stored above, and the synchronous standbys are
+-- determined by each keeper
+ALTER TABLE pgkeeper.node_info DROP COLUMN is_nextmaster;
+ALTER TABLE pgkeeper.node_info DROP COLUMN is_sync;
+
+-- Generation of the modification of each row
+ALTER TABLE pgkeeper.node_info ADD COLUMN generation bigint NOT NULL DEFAULT 0;
+
+-- pg_keeper reads node_info in seqno order through this index
+CREATE UNIQUE INDEX node_info_seqno_idx ON pgkeeper.node_info (seqno);
+
+CREATE FUNCTION pgkeeper.cluster_view(
+OUT seqno integer,
+OUT name text,
+OUT is_master bool,
+OUT is_nextmaster bool,
+OUT is_sync bool,
+OUT reachable bool,
+OUT last_probe timestamptz,
+OUT last_probe_age float8,
+OUT last_seen timestamptz,
+OUT rtt float8,
+OUT lsn pg_lsn,
+OUT misses integer,
+OUT phi float8,
+OUT probe_interval float8,
+OUT probe_lateness float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'cluster_view'
+LANGUAGE C STRICT
+PARALLEL SAFE;
+
+CREATE FUNCTION pgkeeper.gossip(
+version bigint,
+sender text
+)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'gossip'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+REVOKE EXECUTE ON FUNCTION pgkeeper.gossip(bigint, text) FROM PUBLIC;
+
+CREATE FUNCTION pgkeeper.membership(
+OUT version bigint,
+OUT seqno integer,
+OUT name text,
+OUT conninfo text,
+OUT is_master bool
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'membership'
+LANGUAGE C STRICT
+PARALLEL SAFE;
+REVOKE EXECUTE ON FUNCTION pgkeeper.membership() FROM PUBLIC;
+
+CREATE FUNCTION pgkeeper.keeper_command(
+command text
+)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'keeper_command'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+REVOKE ALL ON FUNCTION pgkeeper.keeper_command(text) FROM PUBLIC;
+
+CREATE FUNCTION pgkeeper.memory_usage(
+OUT name text,
+OUT total_bytes bigint,
+OUT used_bytes bigint,
+OUT free_bytes bigint,
+OUT blocks bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'memory_usage'
+LANGUAGE C STRICT
+PARALLEL SAFE;
@@ -0,0 +1,135 @@
+/* pg_keeper/pg_keeper--2.1.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_keeper" to load this file. \quit
+
+-- Create pg_keeper schema
+CREATE SCHEMA pgkeeper;
+
+-- Register ndoe management table
+CREATE TABLE pgkeeper.node_info(
+seqno		serial,
+name		text primary key,
+conninfo	text,
+is_master	bool,
+generation	bigint NOT NULL DEFAULT 0
+);
+
+-- pg_keeper reads node_info in seqno order through this index
+CREATE UNIQUE INDEX node_info_seqno_idx ON pgkeeper.node_info (seqno);
+
+-- Generation of node management table, incremented by each modification,
+-- and the seqno of the next master decided by the master server
+CREATE TABLE pgkeeper.node_info_generation(
+generation	bigint NOT NULL,
+next_master	integer
+);
+INSERT INTO pgkeeper.node_info_generation VALUES (0, NULL);
+
+-- Register node management functions
+CREATE FUNCTION pgkeeper.add_node(
+node_name text,
+conninfo text
+)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'add_node'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+CREATE FUNCTION pgkeeper.del_node(
+node_name text
+)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'del_node'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+CREATE FUNCTION pgkeeper.del_node(
+seqno	integer
+)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'del_node_by_seqno'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+CREATE FUNCTION pgkeeper.indirect_polling(
+conninfo text
+)
+RETURNS BOOL
+AS 'MODULE_PATHNAME', 'indirect_polling'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+CREATE FUNCTION pgkeeper.indirect_kill(
+signal text
+)
+RETURNS BOOL
+AS 'MODULE_PATHNAME', 'indirect_kill'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+CREATE FUNCTION pgkeeper.cluster_view(
+OUT seqno integer,
+OUT name text,
+OUT is_master bool,
+OUT is_nextmaster bool,
+OUT is_sync bool,
+OUT reachable bool,
+OUT last_probe timestamptz,
+OUT last_probe_age float8,
+OUT last_seen timestamptz,
+OUT rtt float8,
+OUT lsn pg_lsn,
+OUT misses integer,
+OUT phi float8,
+OUT probe_interval float8,
+OUT probe_lateness float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'cluster_view'
+LANGUAGE C STRICT
+PARALLEL SAFE;
+
+CREATE FUNCTION pgkeeper.gossip(
+version bigint,
+sender text
+)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'gossip'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+REVOKE EXECUTE ON FUNCTION pgkeeper.gossip(bigint, text) FROM PUBLIC;
+
+CREATE FUNCTION pgkeeper.membership(
+OUT version bigint,
+OUT seqno integer,
+OUT name text,
+OUT conninfo text,
+OUT is_master bool
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'membership'
+LANGUAGE C STRICT
+PARALLEL SAFE;
+REVOKE EXECUTE ON FUNCTION pgkeeper.membership() FROM PUBLIC;
+
+CREATE FUNCTION pgkeeper.keeper_command(
+command text
+)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'keeper_command'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+REVOKE ALL ON FUNCTION pgkeeper.keeper_command(text) FROM PUBLIC;
+
+CREATE FUNCTION pgkeeper.memory_usage(
+OUT name text,
+OUT total_bytes bigint,
+OUT used_bytes bigint,
+OUT free_bytes bigint,
+OUT blocks bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'memory_usage'
+LANGUAGE C STRICT
+PARALLEL SAFE;
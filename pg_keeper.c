@@ -29,7 +29,12 @@
 #include "storage/shmem.h"
 #include "utils/snapmgr.h"
 #include "utils/builtins.h"
+#include "funcapi.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
 #include "utils/rel.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
 
 /* these headers are used by this particular worker's code */
 #include "tcop/utility.h"
@@ -42,11 +47,18 @@ PG_FUNCTION_INFO_V1(del_node);
 PG_FUNCTION_INFO_V1(del_node_by_seqno);
 PG_FUNCTION_INFO_V1(indirect_polling);
 PG_FUNCTION_INFO_V1(indirect_kill);
+PG_FUNCTION_INFO_V1(keeper_command);
+PG_FUNCTION_INFO_V1(cluster_view);
+PG_FUNCTION_INFO_V1(gossip);
+PG_FUNCTION_INFO_V1(membership);
+PG_FUNCTION_INFO_V1(memory_usage);
 
 void	_PG_init(void);
 void	KeeperMain(Datum);
 
 static void checkParameter(void);
+static Tuplestorestate *beginMaterializeSRF(FunctionCallInfo fcinfo,
+											TupleDesc *tupdesc);
 
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static void pg_keeper_shmem_startup(void);
@@ -64,11 +76,14 @@ sig_atomic_t got_sigusr1 = false;
 /* GUC variables */
 int	keeper_keepalives_time;
 int	keeper_keepalives_count;
+int	keeper_suspect_probe_interval;
+double keeper_phi_threshold;
+int	keeper_indirect_cache_time;
+int	keeper_phi_acceptable_pause;
 char *keeper_node_name;
 
 /* Global variables */
 KeeperStatus current_status;
-int 		*PgKeeperPid;
 KeeperNode 	*KeeperRepNodes;
 int 		nKeeperRepNodes;
 bool		promoted = false;
@@ -83,12 +98,8 @@ add_node(PG_FUNCTION_ARGS)
 {
 	text *node_name = PG_GETARG_TEXT_P(0);
 	text *conninfo = PG_GETARG_TEXT_P(1);
-	char *standby_name;
-	bool is_sync = false;
 	bool is_master = false;
 	Relation rel;
-	TupleDesc tupdesc;
-	int i;
 	int num;
 
 	/* Check connection with conninfo */
@@ -99,10 +110,8 @@ add_node(PG_FUNCTION_ARGS)
 		PG_RETURN_BOOL(false);
 	}
 
-	parse_synchronous_standby_names();
 	rel = get_rel_from_relname(cstring_to_text(KEEPER_MANAGE_TABLE_NAME), AccessShareLock,
 							   ACL_SELECT);
-	tupdesc = rel->rd_att;
 	SetCurrentStatementStartTimestamp();
 	SPI_connect();
 	PushActiveSnapshot(GetTransactionSnapshot());
@@ -110,29 +119,14 @@ add_node(PG_FUNCTION_ARGS)
 	/* If no tuple exists, this node will be inserted as a master */
 	getAllRepNodes(&num, false);
 
-	/* First register node mast be master */
+	/*
+	 * First register node mast be master. Whether it's a sync standby is
+	 * determined by keepers, see updateNodeRoles().
+	 */
 	is_master = (num == 0);
 
-	/* Consider this node should be inserted as a sync node */
-	if (!is_master)
-	{
-		standby_name = RepConfig->member_names;
-		for (i = 0; i < RepConfig->nmembers; i++)
-		{
-			if (pg_strcasecmp(standby_name, text_to_cstring(node_name)) == 0)
-			{
-				is_sync = true;
-				break;
-			}
-			standby_name += strlen(standby_name) + 1;
-		}
-	}
-
 	/* insert node as master or standby*/
-	addNewNode(rel->rd_att, node_name, conninfo, is_master, false, is_sync);
-
-	/* Update next mater among with nodes */
-	updateManageTableAccordingToSSNames(false);
+	addNewNode(node_name, conninfo, is_master);
 
 	/* update next master info */
 	//CommitTransactionCommand();
@@ -141,8 +135,8 @@ add_node(PG_FUNCTION_ARGS)
 	SPI_finish();
 	PopActiveSnapshot();
 
-	/* Inform keeper process to update its local cache */
-	kill(*PgKeeperPid, SIGUSR1);
+	/* Inform keeper process to update its local cache once committed */
+	sendKeeperCommand(KEEPER_CMD_NODE_ADDED, text_to_cstring(node_name), true);
 
 	PG_RETURN_BOOL(true);
 }
@@ -162,13 +156,11 @@ del_node(PG_FUNCTION_ARGS)
 
 	ret = deleteNodeByName(node_name);
 
-	updateManageTableAccordingToSSNames(false);
-
 	SPI_finish();
 	PopActiveSnapshot();
 
-	/* Inform keeper process to update its local cache */
-	kill(*PgKeeperPid, SIGUSR1);
+	/* Inform keeper process to update its local cache once committed */
+	sendKeeperCommand(KEEPER_CMD_NODE_REMOVED, node_name, true);
 
 	PG_RETURN_BOOL(ret);
 }
@@ -188,53 +180,327 @@ del_node_by_seqno(PG_FUNCTION_ARGS)
 
 	ret = deleteNodeBySeqno(seqno);
 
-	updateManageTableAccordingToSSNames(false);
-
 	SPI_finish();
 	PopActiveSnapshot();
 
-	/* Inform keeper process to update its local cache */
-	kill(*PgKeeperPid, SIGUSR1);
+	/* Inform keeper process to update its local cache once committed */
+	sendKeeperCommand(KEEPER_CMD_NODE_REMOVED, NULL, true);
 
 	PG_RETURN_BOOL(ret);
 }
 
 /*
  * Polling given server used for indirectly polling.
+ *
+ * If the local keeper has observed the server within
+ * pg_keeper.indirect_cache_time, return its observation instead of
+ * connecting to the server again.
  */
 Datum
 indirect_polling(PG_FUNCTION_ARGS)
 {
-	text *conninfo = PG_GETARG_TEXT_PP(0);
+	char *conninfo = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	bool reachable;
+	TimestampTz observed_at;
 	bool ret;
 
-	ret = heartbeatServer(text_to_cstring(conninfo));
+	if (keeper_indirect_cache_time > 0 &&
+		getCachedObservation(conninfo, &reachable, &observed_at) &&
+		!TimestampDifferenceExceeds(observed_at, GetCurrentTimestamp(),
+									keeper_indirect_cache_time))
+	{
+		long secs;
+		int usecs;
+
+		TimestampDifference(observed_at, GetCurrentTimestamp(), &secs, &usecs);
+		ereport(DEBUG1,
+				(errmsg("answer indirect polling to \"%s\" from the observation of %ld ms ago",
+						conninfo, secs * 1000L + usecs / 1000)));
+
+		PG_RETURN_BOOL(reachable);
+	}
+
+	ret = heartbeatServer(conninfo);
 
 	PG_RETURN_BOOL(ret);
 }
 
 /*
- * Send SIGUSR1 signal to pg_keeper process.
+ * Tell pg_keeper process to reload the nodes, which used to be done by sending
+ * SIGUSR1 signal to it.
  */
 Datum
 indirect_kill(PG_FUNCTION_ARGS)
 {
 	char *signal = text_to_cstring(PG_GETARG_TEXT_PP(0));
-	int pid = *PgKeeperPid;
-	int sig;
 
+	/* SIGUSR1 means reloading the nodes, which is sent as a command */
 	if (pg_strcasecmp(signal, "SIGUSR1") == 0)
-		sig = SIGUSR1;
-	else if (pg_strcasecmp(signal, "SIGUSR1") == 0)
-		sig = SIGUSR1;
+		sendKeeperCommand(KEEPER_CMD_NODE_CHANGED, NULL, false);
 	else
 		ereport(ERROR, (errmsg("Invalid signal \"%s\"", signal)));
 
-	kill(pid, sig);
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Send given command to pg_keeper process on executed server. "reload" makes
+ * pg_keeper reload the management table, "reload_config" the configuration
+ * file, and "probe" start polling immediately.
+ */
+Datum
+keeper_command(PG_FUNCTION_ARGS)
+{
+	char *command = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+	if (pg_strcasecmp(command, "reload") == 0)
+		sendKeeperCommand(KEEPER_CMD_NODE_CHANGED, NULL, false);
+	else if (pg_strcasecmp(command, "reload_config") == 0)
+		sendKeeperCommand(KEEPER_CMD_RELOAD_CONFIG, NULL, false);
+	else if (pg_strcasecmp(command, "probe") == 0)
+		sendKeeperCommand(KEEPER_CMD_FORCE_PROBE, NULL, false);
+	else
+		ereport(ERROR, (errmsg("Invalid command \"%s\"", command)));
 
 	PG_RETURN_BOOL(true);
 }
 
+/*
+ * Set up the tuplestore to return the result of set-returning function in
+ * materialize mode, and return it. The tuple descriptor is stored into tupdesc.
+ */
+static Tuplestorestate *
+beginMaterializeSRF(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+/*
+ * Return the cluster view of local pg_keeper, that is the role of each node and
+ * the latest result of polling to it, from the registry in shared memory.
+ */
+Datum
+cluster_view(PG_FUNCTION_ARGS)
+{
+#define CLUSTER_VIEW_COLS 15
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	KeeperSharedNode *nodes;
+	KeeperStatus status;
+	TimestampTz now = GetCurrentTimestamp();
+	int64 version;
+	bool truncated;
+	int nnodes;
+	int i;
+
+	tupstore = beginMaterializeSRF(fcinfo, &tupdesc);
+
+	nodes = getClusterSnapshot(&nnodes, &status, &version, &truncated);
+
+	for (i = 0; i < nnodes; i++)
+	{
+		KeeperSharedNode *node = &(nodes[i]);
+		Datum values[CLUSTER_VIEW_COLS];
+		bool nulls[CLUSTER_VIEW_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(node->seqno);
+		values[1] = CStringGetTextDatum(node->name);
+		values[2] = BoolGetDatum(node->is_master);
+		values[3] = BoolGetDatum(node->is_nextmaster);
+		values[4] = BoolGetDatum(node->is_sync);
+		values[5] = BoolGetDatum(node->reachable);
+
+		/* last_probe and its age in milliseconds */
+		if (node->last_probe != 0)
+		{
+			values[6] = TimestampTzGetDatum(node->last_probe);
+			values[7] = Float8GetDatum((double) (now - node->last_probe) / 1000.0);
+		}
+		else
+			nulls[6] = nulls[7] = true;
+
+		if (node->last_seen != 0)
+			values[8] = TimestampTzGetDatum(node->last_seen);
+		else
+			nulls[8] = true;
+
+		/* rtt in milliseconds */
+		if (node->rtt >= 0)
+			values[9] = Float8GetDatum((double) node->rtt / 1000.0);
+		else
+			nulls[9] = true;
+
+		if (!XLogRecPtrIsInvalid(node->lsn))
+			values[10] = LSNGetDatum(node->lsn);
+		else
+			nulls[10] = true;
+
+		values[11] = Int32GetDatum(node->misses);
+		values[12] = Float8GetDatum(node->phi);
+
+		/* Schedule of polling in milliseconds, only for the nodes we poll */
+		if (node->probe_interval > 0)
+		{
+			values[13] = Float8GetDatum((double) node->probe_interval / 1000.0);
+			values[14] = Float8GetDatum((double) node->probe_lateness / 1000.0);
+		}
+		else
+			nulls[13] = nulls[14] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(nodes);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Tell pg_keeper on executed server that sender has the membership of given
+ * version, and return the membership version of pg_keeper on executed server.
+ * This is piggybacked on the heartbeats between keepers. See gossip.c.
+ */
+Datum
+gossip(PG_FUNCTION_ARGS)
+{
+	int64 version = PG_GETARG_INT64(0);
+	char *sender = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+	PG_RETURN_INT64(recordGossip(version, sender));
+}
+
+/*
+ * Return the membership known by pg_keeper on executed server along with its
+ * version, which other keepers pull when they learned it's newer than theirs.
+ */
+Datum
+membership(PG_FUNCTION_ARGS)
+{
+#define MEMBERSHIP_COLS 5
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	KeeperSharedNode *nodes;
+	KeeperStatus status;
+	int64 version;
+	bool truncated;
+	int nnodes;
+	int i;
+
+	tupstore = beginMaterializeSRF(fcinfo, &tupdesc);
+
+	nodes = getClusterSnapshot(&nnodes, &status, &version, &truncated);
+
+	/* A part of the membership would make other keepers forget the rest */
+	if (truncated)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("membership of pg_keeper does not fit in shared memory"),
+				 errhint("Increase pg_keeper.max_nodes, or make conninfo of each node shorter than %d bytes.",
+						 KEEPER_MAX_CONNINFO_LEN)));
+
+	for (i = 0; i < nnodes; i++)
+	{
+		KeeperSharedNode *node = &(nodes[i]);
+		Datum values[MEMBERSHIP_COLS];
+		bool nulls[MEMBERSHIP_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int64GetDatum(version);
+		values[1] = Int32GetDatum(node->seqno);
+		values[2] = CStringGetTextDatum(node->name);
+		values[3] = CStringGetTextDatum(node->conninfo);
+		values[4] = BoolGetDatum(node->is_master);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(nodes);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the memory usage of the keeper process by memory context, which the
+ * keeper publishes every 10 seconds.
+ */
+Datum
+memory_usage(PG_FUNCTION_ARGS)
+{
+#define MEMORY_USAGE_COLS 5
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	KeeperMemoryUsage usage[KEEPER_NUM_MEMORY_CONTEXTS];
+	int i;
+
+	tupstore = beginMaterializeSRF(fcinfo, &tupdesc);
+
+	getMemoryUsage(usage);
+
+	for (i = 0; i < KEEPER_NUM_MEMORY_CONTEXTS; i++)
+	{
+		Datum values[MEMORY_USAGE_COLS];
+		bool nulls[MEMORY_USAGE_COLS];
+
+		/* The keeper has not published yet */
+		if (usage[i].name[0] == '\0')
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(usage[i].name);
+		values[1] = Int64GetDatum((int64) usage[i].total_bytes);
+		values[2] = Int64GetDatum((int64) (usage[i].total_bytes - usage[i].free_bytes));
+		values[3] = Int64GetDatum((int64) usage[i].free_bytes);
+		values[4] = Int64GetDatum((int64) usage[i].nblocks);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
 /*
  * Entrypoint of this module.
  *
@@ -254,11 +520,24 @@ _PG_init(void)
 							"Specific time between polling to primary server",
 							NULL,
 							&keeper_keepalives_time,
-							5,
-							1,
+							5000,
+							10,
 							INT_MAX,
 							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.suspect_probe_interval",
+							"Time between polling to a node after polling to it failed",
+							"Zero polls at keepalives_time regardless of failure.",
+							&keeper_suspect_probe_interval,
+							0,
 							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
 							NULL,
 							NULL,
 							NULL);
@@ -267,7 +546,7 @@ _PG_init(void)
 							"Specific retry count until promoting standby server",
 							NULL,
 							&keeper_keepalives_count,
-							1,
+							2,
 							1,
 							INT_MAX,
 							PGC_SIGHUP,
@@ -276,6 +555,84 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomRealVariable("pg_keeper.phi_threshold",
+							 "Suspicion level at which a node is regarded as failed",
+							 "Zero uses pg_keeper.keepalives_count instead.",
+							 &keeper_phi_threshold,
+							 0,
+							 0,
+							 DBL_MAX,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_keeper.phi_acceptable_pause",
+							"Pause of heartbeat tolerated by the failure detector",
+							NULL,
+							&keeper_phi_acceptable_pause,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.stream_liveness_time",
+							"Time within which replication activity is regarded as heartbeat",
+							"Zero always polls via SQL.",
+							&keeper_stream_liveness_time,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.indirect_cache_time",
+							"Maximum age of the observation used to answer indirect polling",
+							"Zero always polls to the server.",
+							&keeper_indirect_cache_time,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.indirect_probe_fanout",
+							"Number of standbys asked to poll to the master after direct polling failed",
+							"Zero asks all standbys at every polling.",
+							&keeper_indirect_probe_fanout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.max_nodes",
+							"Maximum number of nodes published to shared memory",
+							NULL,
+							&keeper_max_nodes,
+							16,
+							1,
+							1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomStringVariable("pg_keeper.after_command",
 							   "Shell command that will be called after promoted",
 							   NULL,
@@ -306,10 +663,17 @@ _PG_init(void)
 	worker.bgw_main = KeeperMain;
 	worker.bgw_notify_pid = 0;
 
+	/* Request shared memory and lock for the cluster registry */
+	RequestAddinShmemSpace(keeperShmemSize());
+	RequestNamedLWLockTranche("pg_keeper", 1);
+
 	/* Install hooks */
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = pg_keeper_shmem_startup;
 
+	/* Send the commands to keeper when the transaction commits */
+	RegisterXactCallback(keeperXactCallback, NULL);
+
 	/*
 	 * Now fill in worker-specific data, and do the actual registrations.
 	 */
@@ -367,19 +731,10 @@ pg_keeper_sigusr1(SIGNAL_ARGS)
 static void
 pg_keeper_shmem_startup(void)
 {
-	bool found;
-	int shmem_size;
-
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
 
-	shmem_size = MAXALIGN(sizeof(int));
-
-	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
-	PgKeeperPid = ShmemInitStruct("pg_keeper",
-								  shmem_size,
-								  &found);
-	LWLockRelease(AddinShmemInitLock);
+	keeperShmemInit();
 }
 
 /*
@@ -407,12 +762,30 @@ KeeperMain(Datum main_arg)
 	/* Connect to our database */
 	BackgroundWorkerInitializeConnection("postgres", NULL);
 
-	/* Register my processid to shmem */
-	*PgKeeperPid = MyProcPid;
+	/* Register my processid and latch to shmem */
+	KeeperShmem->keeper_pid = MyProcPid;
+	KeeperShmem->keeper_latch = &MyProc->procLatch;
+
+	/*
+	 * The main loops allocate in this, and free it at each tick. The first
+	 * block is kept across resets, so a tick allocating less than it doesn't
+	 * call malloc at all.
+	 */
+	KeeperTickContext = AllocSetContextCreate(TopMemoryContext,
+											  "pg_keeper tick",
+											  KEEPER_TICK_CONTEXT_SIZE,
+											  KEEPER_TICK_CONTEXT_SIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+
+	/* Keepers should choose different peers for probing and gossip */
+	srandom((unsigned int) (MyProcPid ^ GetCurrentTimestamp()));
 
 	/* Parse and fetch configuration for synchronous replication */
 	parse_synchronous_standby_names();
 
+	/* Learn the modification of the management table by invalidation */
+	registerNodeInfoCallbacks();
+
 exec:
 	if (current_status == KEEPER_MASTER_READY)
 	{
@@ -522,22 +895,21 @@ checkParameter()
 char *
 getStatusPsString(KeeperStatus status, int num)
 {
-	StringInfoData str;
-
-	initStringInfo(&str);
+	/* Overwritten by each call, which is fine for set_ps_display() */
+	static char str[64];
 
 	if (status == KEEPER_STANDBY_READY)
 		return "(standby:ready)";
 	else if (status == KEEPER_STANDBY_CONNECTED)
-		appendStringInfo(&str, "(standby:connected, %d)", num);
+		snprintf(str, sizeof(str), "(standby:connected, %d)", num);
 	else if (status == KEEPER_STANDBY_ALONE)
-		appendStringInfo(&str, "(standby:alone, %d)", num);
+		snprintf(str, sizeof(str), "(standby:alone, %d)", num);
 	else if (status == KEEPER_MASTER_READY)
-		appendStringInfo(&str, "(master:ready, %d)", num);
+		snprintf(str, sizeof(str), "(master:ready, %d)", num);
 	else if (status == KEEPER_MASTER_CONNECTED)
-		appendStringInfo(&str, "(master:connected, %d)", num);
+		snprintf(str, sizeof(str), "(master:connected, %d)", num);
 	else /* status == KEEPER_MASTER_ASYNC) */
-		appendStringInfo(&str, "(master:async, %d)", num);
+		snprintf(str, sizeof(str), "(master:async, %d)", num);
 
-	return str.data;
+	return str;
 }
@@ -17,12 +17,27 @@
 #include "storage/proc.h"
 #include "storage/shmem.h"
 
+#include "access/xact.h"
 #include "tcop/utility.h"
 #include "libpq-int.h"
+#include "datatype/timestamp.h"
 
+#include "detector.h"
+
+#define KEEPER_SCHEMA_NAME "pgkeeper"
+#define KEEPER_MANAGE_TABLE_RELNAME "node_info"
 #define KEEPER_MANAGE_TABLE_NAME "pgkeeper.node_info"
-#define KEEPER_NUM_ATTS 5 /* Except for seqno */
+#define KEEPER_MANAGE_INDEX_RELNAME "node_info_seqno_idx"
+#define KEEPER_GENERATION_TABLE_RELNAME "node_info_generation"
+#define KEEPER_GENERATION_TABLE_NAME "pgkeeper.node_info_generation"
+#define KEEPER_NUM_ATTS 3 /* Except for seqno and generation */
+
+/* Attributes of the management table, read directly by updateLocalCache() */
 #define HEARTBEAT_SQL "SELECT 1"
+#define KEEPER_SQL_GOSSIP "SELECT %s"	/* heartbeat between keepers, see gossip.c */
+#define KEEPER_MAX_CONNINFO_LEN 1024	/* conninfo length in the registry */
+#define KEEPER_COMMAND_QUEUE_SIZE 64	/* slots of the command queue */
+#define KEEPER_TICK_CONTEXT_SIZE (64 * 1024)	/* kept block of tick context */
 
 typedef enum KeeperStatus
 {
@@ -42,8 +57,109 @@ typedef struct KeeperNode
 	bool is_master;
 	bool is_nextmaster;
 	bool is_sync;
+	PGconn *conn;		/* pooled heartbeat connection, see heartbeat.c */
+	KeeperDetector detector;	/* failure detector, see detector.c */
+
+	/* Replication activity of standby, updated by updateStreamState() */
+	XLogRecPtr stream_write;
+	XLogRecPtr stream_flush;
+	int64 stream_progress;	/* monotonic time when positions advanced */
+	bool stream_alive;
+
+	/* Result of polling, published to the registry */
+	bool reachable;			/* true if our last observation succeeded */
+	TimestampTz last_probe;	/* when we observed the node directly last time */
+	TimestampTz last_seen;	/* when we got heartbeat, directly or indirectly */
+	int64 rtt;				/* round trip time in microseconds, -1 if unknown */
+
+	/* Schedule of polling to the node, see schedule.c */
+	int64 next_probe;		/* monotonic time of next polling */
+	int64 probe_interval;	/* in microseconds, 0 if we don't poll to it */
+	int64 probe_lateness;	/* how late we were for the last deadline */
 } KeeperNode;
 
+/* Type of command sent from backends to the keeper. See command.c */
+typedef enum KeeperCommandType
+{
+	KEEPER_CMD_NODE_ADDED = 0,
+	KEEPER_CMD_NODE_REMOVED,
+	KEEPER_CMD_NODE_CHANGED,
+	KEEPER_CMD_RELOAD_CONFIG,
+	KEEPER_CMD_FORCE_PROBE
+} KeeperCommandType;
+
+typedef struct KeeperCommand
+{
+	KeeperCommandType type;
+	char name[NAMEDATALEN];		/* name of the node if any */
+} KeeperCommand;
+
+/* What the keeper should do for the received commands, coalesced */
+typedef struct KeeperCommandSet
+{
+	bool reload_nodes;
+	bool reload_config;
+	bool force_probe;
+} KeeperCommandSet;
+
+/*
+ * Shared state of a node in the cluster registry. See registry.c.
+ */
+typedef struct KeeperSharedNode
+{
+	int	seqno;
+	char name[NAMEDATALEN];
+	char conninfo[KEEPER_MAX_CONNINFO_LEN];
+	bool is_master;
+	bool is_nextmaster;
+	bool is_sync;
+	bool reachable;			/* result of our own observation */
+	TimestampTz last_probe;
+	TimestampTz last_seen;
+	int64 rtt;
+	int64 probe_interval;
+	int64 probe_lateness;
+	XLogRecPtr lsn;			/* last seen WAL position */
+	int misses;
+	double phi;				/* suspicion level when published */
+} KeeperSharedNode;
+
+/*
+ * Memory usage of a memory context of the keeper, including its descendants.
+ * See pgkeeper.memory_usage().
+ */
+#define KEEPER_NUM_MEMORY_CONTEXTS 3
+typedef struct KeeperMemoryUsage
+{
+	char name[NAMEDATALEN];
+	Size total_bytes;
+	Size free_bytes;
+	Size nblocks;
+} KeeperMemoryUsage;
+
+typedef struct KeeperShmemStruct
+{
+	pid_t keeper_pid;		/* pid of keeper process */
+	Latch *keeper_latch;	/* latch of keeper process, set by commands */
+	LWLock *lock;			/* serializes the writers of registry */
+	uint32 changecount;		/* odd while the registry is being written */
+	KeeperStatus status;
+	int64 version;			/* membership version of nodes, see gossip.c */
+	bool truncated;			/* nodes don't hold the whole membership */
+	int64 gossip_version;	/* newest membership version told by others */
+	char gossip_source[NAMEDATALEN];	/* name of node telling it */
+	KeeperMemoryUsage memory[KEEPER_NUM_MEMORY_CONTEXTS];
+
+	/* Command queue from backends, protected by lock. See command.c */
+	uint64 command_head;	/* next slot to be written */
+	uint64 command_tail;	/* next slot to be read */
+	bool command_overflow;	/* some commands were dropped */
+	KeeperCommand commands[KEEPER_COMMAND_QUEUE_SIZE];
+
+	int nnodes;
+	KeeperSharedNode nodes[FLEXIBLE_ARRAY_MEMBER];
+} KeeperShmemStruct;
+
 /* pg_keeper.c */
 extern void	_PG_init(void);
 extern void	KeeperMain(Datum);
@@ -57,6 +173,39 @@ extern sig_atomic_t got_sigusr1;
 
 extern char *getStatusPsString(KeeperStatus status, int num);
 
+/* registry.c */
+extern KeeperShmemStruct *KeeperShmem;
+extern Size keeperShmemSize(void);
+extern void keeperShmemInit(void);
+extern void publishClusterState(void);
+extern KeeperSharedNode *getClusterSnapshot(int *nnodes, KeeperStatus *status,
+											 int64 *version, bool *truncated);
+extern bool getCachedObservation(const char *conninfo, bool *reachable,
+								 TimestampTz *observed_at);
+extern int64 recordGossip(int64 version, const char *sender);
+extern int64 takeGossip(char *source);
+extern void getMemoryUsage(KeeperMemoryUsage *usage);
+
+/* command.c */
+extern void sendKeeperCommand(KeeperCommandType type, const char *name,
+							  bool at_commit);
+extern void receiveKeeperCommands(KeeperCommandSet *set);
+extern void keeperXactCallback(XactEvent event, void *arg);
+
+/* gossip.c */
+extern int64 KeeperMembershipVersion;
+extern const char *getGossipSQL(const char *fmt);
+extern void gossipReceive(KeeperNode *node, PGresult *res, int column);
+extern void gossipTick(void);
+
+/* schedule.c */
+extern void buildProbeSchedule(void);
+extern int64 nextProbeDeadline(void);
+extern int	takeDueProbes(int64 now, KeeperNode ***due);
+extern void expediteProbes(int64 now);
+extern void adaptProbeSchedule(void);
+extern int64 nextFixedDeadline(int64 deadline, int64 interval, int64 now);
+
 /* master.c */
 extern bool KeeperMainMaster(void);
 extern void setupKeeperMaster(void);
@@ -68,7 +217,14 @@ extern void setupKeeperStandby(void);
 /* GUC variables */
 extern int	keeper_keepalives_time;
 extern int	keeper_keepalives_count;
+extern int	keeper_suspect_probe_interval;
+extern double keeper_phi_threshold;
+extern int	keeper_phi_acceptable_pause;
 extern char *keeper_after_command;
+extern int	keeper_stream_liveness_time;
+extern int	keeper_max_nodes;
+extern int	keeper_indirect_cache_time;
+extern int	keeper_indirect_probe_fanout;
 extern char *keeper_node_name;
 
 /* Variables for cluster management */
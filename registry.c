@@ -0,0 +1,394 @@
+/* -------------------------------------------------------------------------
+ *
+ * registry.c
+ *
+ * Shared memory cluster registry for pg_keeper.
+ *
+ * The keeper process publishes its view of the cluster, that is the role of
+ * each node and the result of the latest polling to it, into shared memory so
+ * that any backend can read it without SPI or table scans. Only the keeper
+ * writes the registry. Writers are serialized by an LWLock, and readers take
+ * a consistent snapshot without any lock using the change count, like
+ * PgBackendStatus does: the writer increments it before and after writing,
+ * so an odd value or a change during copying means the reader must retry.
+ *
+ * The registry also carries the gossip of membership from other keepers, which
+ * is written by backends executing pgkeeper.gossip(). See gossip.c.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pg_keeper.h"
+#include "util.h"
+
+#include "access/xlog.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+
+/*
+ * Interval of publishing the memory usage in microseconds. Summing up the
+ * memory contexts walks the whole tree, so it's not done at each tick.
+ */
+#define KEEPER_MEMORY_USAGE_INTERVAL (10 * 1000000L)
+
+/* GUC variables */
+int		keeper_max_nodes;
+
+/* Pointer to shared memory */
+KeeperShmemStruct *KeeperShmem = NULL;
+
+static bool membershipFits(void);
+static void copyToSharedNode(KeeperSharedNode *shared, KeeperNode *node);
+static void copyMemoryUsage(KeeperMemoryUsage *usage, const char *name,
+							MemoryContext context);
+static void sumMemoryContext(MemoryContext context,
+							 MemoryContextCounters *totals);
+
+/*
+ * Return the size of shared memory for the registry.
+ */
+Size
+keeperShmemSize(void)
+{
+	return add_size(offsetof(KeeperShmemStruct, nodes),
+					mul_size(sizeof(KeeperSharedNode), keeper_max_nodes));
+}
+
+/*
+ * Allocate and initialize the registry, called from shmem startup hook.
+ */
+void
+keeperShmemInit(void)
+{
+	bool found;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	KeeperShmem = ShmemInitStruct("pg_keeper",
+								  keeperShmemSize(),
+								  &found);
+
+	if (!found)
+	{
+		memset(KeeperShmem, 0, keeperShmemSize());
+		KeeperShmem->lock = &(GetNamedLWLockTranche("pg_keeper"))->lock;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Copy the local state of node to the shared one.
+ */
+static void
+copyToSharedNode(KeeperSharedNode *shared, KeeperNode *node)
+{
+	shared->seqno = node->seqno;
+	strlcpy(shared->name, node->name, NAMEDATALEN);
+	strlcpy(shared->conninfo, node->conninfo, KEEPER_MAX_CONNINFO_LEN);
+	shared->is_master = node->is_master;
+	shared->is_nextmaster = node->is_nextmaster;
+	shared->is_sync = node->is_sync;
+	shared->reachable = node->reachable;
+	shared->last_probe = node->last_probe;
+	shared->last_seen = node->last_seen;
+	shared->rtt = node->rtt;
+	shared->probe_interval = node->probe_interval;
+	shared->probe_lateness = node->probe_lateness;
+
+	/* We know the latest WAL position of ourselves */
+	if (pg_strcasecmp(node->name, keeper_node_name) == 0)
+		shared->lsn = RecoveryInProgress() ?
+			GetXLogReplayRecPtr(NULL) : GetFlushRecPtr();
+	else
+		shared->lsn = node->stream_flush;
+	shared->misses = node->detector.misses;
+	shared->phi = detectorPhi(&(node->detector), getMonotonicTime());
+}
+
+/*
+ * Copy the memory usage of context and its descendants to the shared one.
+ */
+static void
+copyMemoryUsage(KeeperMemoryUsage *usage, const char *name,
+				MemoryContext context)
+{
+	MemoryContextCounters totals;
+
+	memset(&totals, 0, sizeof(totals));
+	if (context != NULL)
+		sumMemoryContext(context, &totals);
+
+	strlcpy(usage->name, name, NAMEDATALEN);
+	usage->total_bytes = totals.totalspace;
+	usage->free_bytes = totals.freespace;
+	usage->nblocks = totals.nblocks;
+}
+
+/*
+ * Add up the counters of context and its descendants to totals.
+ */
+static void
+sumMemoryContext(MemoryContext context, MemoryContextCounters *totals)
+{
+	MemoryContext child;
+
+	(*context->methods->stats) (context, 0, false, totals);
+
+	for (child = context->firstchild; child != NULL; child = child->nextchild)
+		sumMemoryContext(child, totals);
+}
+
+/*
+ * Return true if the registry can hold the whole of KeeperRepNodes.
+ */
+static bool
+membershipFits(void)
+{
+	int i;
+
+	if (nKeeperRepNodes > keeper_max_nodes)
+		return false;
+
+	for (i = 0; i < nKeeperRepNodes; i++)
+	{
+		if (strlen(KeeperRepNodes[i].conninfo) >= KEEPER_MAX_CONNINFO_LEN)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Publish the current status of keeper and KeeperRepNodes to the registry.
+ * The nodes exceeding pg_keeper.max_nodes are not published, and the registry
+ * is marked as truncated so that pgkeeper.membership() doesn't serve them.
+ */
+void
+publishClusterState(void)
+{
+	static int64 warned_version = -1;
+	static int64 memory_published = 0;
+	KeeperMemoryUsage memory[KEEPER_NUM_MEMORY_CONTEXTS];
+	int64 now = getMonotonicTime();
+	bool publish_memory;
+	int nnodes = Min(nKeeperRepNodes, keeper_max_nodes);
+	bool truncated = !membershipFits();
+	int i;
+
+	/* Warn once per membership, the status is published at each tick */
+	if (truncated && warned_version != KeeperMembershipVersion)
+	{
+		ereport(WARNING,
+				(errmsg("pg_keeper could not publish the whole membership of %d nodes",
+						nKeeperRepNodes),
+				 errdetail("Other keepers can't pull the membership from this server."),
+				 errhint("Increase pg_keeper.max_nodes to at least %d, and make conninfo of each node shorter than %d bytes.",
+						 nKeeperRepNodes, KEEPER_MAX_CONNINFO_LEN)));
+		warned_version = KeeperMembershipVersion;
+	}
+	else if (!truncated)
+		warned_version = -1;
+
+	/*
+	 * Sum up the memory usage at a low fixed rate, outside of the lock. The
+	 * tick context shows how much the tick has allocated so far.
+	 */
+	publish_memory = (memory_published == 0 ||
+					  now - memory_published >= KEEPER_MEMORY_USAGE_INTERVAL);
+	if (publish_memory)
+	{
+		copyMemoryUsage(&(memory[0]), "TopMemoryContext", TopMemoryContext);
+		copyMemoryUsage(&(memory[1]), "pg_keeper node cache",
+						KeeperCacheContext);
+		copyMemoryUsage(&(memory[2]), "pg_keeper tick", KeeperTickContext);
+		memory_published = now;
+	}
+
+	LWLockAcquire(KeeperShmem->lock, LW_EXCLUSIVE);
+
+	KeeperShmem->changecount++;
+	pg_write_barrier();
+
+	KeeperShmem->status = current_status;
+	KeeperShmem->version = KeeperMembershipVersion;
+	KeeperShmem->truncated = truncated;
+	KeeperShmem->nnodes = nnodes;
+	for (i = 0; i < nnodes; i++)
+		copyToSharedNode(&(KeeperShmem->nodes[i]), &(KeeperRepNodes[i]));
+
+	if (publish_memory)
+		memcpy(KeeperShmem->memory, memory, sizeof(memory));
+
+	pg_write_barrier();
+	KeeperShmem->changecount++;
+
+	LWLockRelease(KeeperShmem->lock);
+}
+
+/*
+ * Return a consistent snapshot of the registry, palloc'd in the current memory
+ * context. The number of nodes, the keeper status, the membership version and
+ * whether the nodes are truncated are stored into nnodes, status, version and
+ * truncated respectively.
+ */
+KeeperSharedNode *
+getClusterSnapshot(int *nnodes, KeeperStatus *status, int64 *version,
+				   bool *truncated)
+{
+	KeeperSharedNode *nodes;
+
+	nodes = palloc(sizeof(KeeperSharedNode) * keeper_max_nodes);
+
+	for (;;)
+	{
+		uint32 before;
+		uint32 after;
+
+		before = KeeperShmem->changecount;
+		pg_read_barrier();
+
+		*status = KeeperShmem->status;
+		*version = KeeperShmem->version;
+		*truncated = KeeperShmem->truncated;
+		*nnodes = Min(KeeperShmem->nnodes, keeper_max_nodes);
+		memcpy(nodes, KeeperShmem->nodes, sizeof(KeeperSharedNode) * (*nnodes));
+
+		pg_read_barrier();
+		after = KeeperShmem->changecount;
+
+		if (before == after && (before & 1) == 0)
+			break;
+
+		/* Make sure we can break out of loop if stuck */
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	return nodes;
+}
+
+/*
+ * Store a consistent snapshot of the memory usage of the keeper into usage,
+ * which must have KEEPER_NUM_MEMORY_CONTEXTS entries.
+ */
+void
+getMemoryUsage(KeeperMemoryUsage *usage)
+{
+	for (;;)
+	{
+		uint32 before;
+		uint32 after;
+
+		before = KeeperShmem->changecount;
+		pg_read_barrier();
+
+		memcpy(usage, KeeperShmem->memory,
+			   sizeof(KeeperMemoryUsage) * KEEPER_NUM_MEMORY_CONTEXTS);
+
+		pg_read_barrier();
+		after = KeeperShmem->changecount;
+
+		if (before == after && (before & 1) == 0)
+			break;
+
+		/* Make sure we can break out of loop if stuck */
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Look up the latest observation by the keeper of the node having the given
+ * conninfo. Return false if the keeper has never observed such node.
+ */
+bool
+getCachedObservation(const char *conninfo, bool *reachable,
+					 TimestampTz *observed_at)
+{
+	KeeperSharedNode *nodes;
+	KeeperStatus status;
+	int64 version;
+	bool truncated;
+	int nnodes;
+	int i;
+	bool found = false;
+
+	nodes = getClusterSnapshot(&nnodes, &status, &version, &truncated);
+
+	for (i = 0; i < nnodes; i++)
+	{
+		if (nodes[i].last_probe != 0 &&
+			strcmp(nodes[i].conninfo, conninfo) == 0)
+		{
+			*reachable = nodes[i].reachable;
+			*observed_at = nodes[i].last_probe;
+			found = true;
+			break;
+		}
+	}
+
+	pfree(nodes);
+
+	return found;
+}
+
+/*
+ * Record that sender has the membership of given version, if it's newer than
+ * ours and than any other we have been told. Return our membership version.
+ *
+ * The sender must be a member of our membership, otherwise it's ignored. A
+ * node joining the cluster learns the membership from the master server, so
+ * anyone having newer membership is known to us, or is told by others later.
+ */
+int64
+recordGossip(int64 version, const char *sender)
+{
+	int64 own;
+	bool known = false;
+	int i;
+
+	LWLockAcquire(KeeperShmem->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < KeeperShmem->nnodes; i++)
+	{
+		if (pg_strcasecmp(KeeperShmem->nodes[i].name, sender) == 0)
+		{
+			known = true;
+			break;
+		}
+	}
+
+	/* Nobody can pull the membership from us unless it's whole */
+	own = KeeperShmem->truncated ? 0 : KeeperShmem->version;
+	if (known && version > own && version > KeeperShmem->gossip_version)
+	{
+		KeeperShmem->gossip_version = version;
+		strlcpy(KeeperShmem->gossip_source, sender, NAMEDATALEN);
+	}
+
+	LWLockRelease(KeeperShmem->lock);
+
+	return own;
+}
+
+/*
+ * Return the newest membership version we have been told by others since the
+ * last call, and store the name of node telling it into source, which must be
+ * NAMEDATALEN long.
+ */
+int64
+takeGossip(char *source)
+{
+	int64 version;
+
+	LWLockAcquire(KeeperShmem->lock, LW_EXCLUSIVE);
+	version = KeeperShmem->gossip_version;
+	strlcpy(source, KeeperShmem->gossip_source, NAMEDATALEN);
+
+	/* Forget it, so that a bogus version doesn't stick until restart */
+	KeeperShmem->gossip_version = 0;
+	LWLockRelease(KeeperShmem->lock);
+
+	return version;
+}
@@ -0,0 +1,273 @@
+/* -------------------------------------------------------------------------
+ *
+ * schedule.c
+ *
+ * Probe scheduler of pg_keeper.
+ *
+ * Each node we poll has its own deadline of next polling and interval, and the
+ * nodes are kept in a min-heap keyed on the deadline. The main loop sleeps
+ * until the nearest deadline, takes the nodes which are due, and advances their
+ * deadlines by their intervals. Since a deadline is advanced from the previous
+ * deadline rather than the time we actually polled, the polling stays on a
+ * fixed rate even when some nodes are slow to respond.
+ *
+ * If pg_keeper.suspect_probe_interval is set, the interval of a node shrinks
+ * to it once polling to the node failed, and doubles at each failure in a row
+ * up to keepalives_time. So a failure is confirmed quickly while the healthy
+ * nodes are polled at keepalives_time. The interval is back to keepalives_time
+ * as soon as we get heartbeat from the node.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "lib/binaryheap.h"
+#include "utils/memutils.h"
+
+#include "pg_keeper.h"
+#include "util.h"
+
+/* Nodes to be polled ordered by next_probe, pointing into KeeperRepNodes */
+static binaryheap *ProbeSchedule = NULL;
+
+/* Returned by takeDueProbes(), sized for ProbeSchedule */
+static KeeperNode **DueProbes = NULL;
+
+static bool isScheduledNode(KeeperNode *node);
+static int64 getProbeInterval(KeeperNode *node);
+static int	compareProbeDeadline(Datum a, Datum b, void *arg);
+
+/*
+ * Return true if we poll to node in the current mode. The master keeper polls
+ * to the synchronous standbys, and the standby keeper polls to the master.
+ */
+static bool
+isScheduledNode(KeeperNode *node)
+{
+	if (pg_strcasecmp(node->name, keeper_node_name) == 0)
+		return false;
+
+	if (current_status >= KEEPER_MASTER_READY)
+		return !node->is_master && node->is_sync;
+
+	return node->is_master;
+}
+
+/*
+ * Return the interval of polling to node in microseconds, which depends on how
+ * many times polling to it failed in a row.
+ */
+static int64
+getProbeInterval(KeeperNode *node)
+{
+	int64 interval = keeper_keepalives_time * 1000L;
+	int64 suspect_interval;
+	int misses = node->detector.misses;
+
+	if (keeper_suspect_probe_interval == 0 || misses == 0)
+		return interval;
+
+	/* Exponentially spaced, avoiding overflow */
+	suspect_interval = keeper_suspect_probe_interval * 1000L;
+	while (--misses > 0 && suspect_interval < interval)
+		suspect_interval *= 2;
+
+	return Min(suspect_interval, interval);
+}
+
+/*
+ * binaryheap is a max-heap, so the node having earlier deadline is greater.
+ */
+static int
+compareProbeDeadline(Datum a, Datum b, void *arg)
+{
+	KeeperNode *node_a = (KeeperNode *) DatumGetPointer(a);
+	KeeperNode *node_b = (KeeperNode *) DatumGetPointer(b);
+
+	if (node_a->next_probe < node_b->next_probe)
+		return 1;
+	if (node_a->next_probe > node_b->next_probe)
+		return -1;
+	return 0;
+}
+
+/*
+ * Rebuild the schedule from KeeperRepNodes, which must be called whenever the
+ * cache or the roles of nodes are changed. The deadlines inherited from the
+ * previous cache are kept, so reloading doesn't disturb the cadence.
+ */
+void
+buildProbeSchedule(void)
+{
+	int64 now = getMonotonicTime();
+	int i;
+
+	/* The storage is kept in TopMemoryContext and grown as needed */
+	if (ProbeSchedule == NULL || ProbeSchedule->bh_space < nKeeperRepNodes)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		if (ProbeSchedule != NULL)
+		{
+			binaryheap_free(ProbeSchedule);
+			pfree(DueProbes);
+		}
+
+		ProbeSchedule = binaryheap_allocate(Max(nKeeperRepNodes, 16),
+											compareProbeDeadline, NULL);
+		DueProbes = palloc(sizeof(KeeperNode *) * ProbeSchedule->bh_space);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	binaryheap_reset(ProbeSchedule);
+
+	for (i = 0; i < nKeeperRepNodes; i++)
+	{
+		KeeperNode *node = &(KeeperRepNodes[i]);
+
+		if (!isScheduledNode(node))
+		{
+			node->probe_interval = 0;
+			continue;
+		}
+
+		/* The parameters might be changed by reloading */
+		node->probe_interval = getProbeInterval(node);
+		if (node->next_probe > now + node->probe_interval)
+			node->next_probe = now + node->probe_interval;
+
+		binaryheap_add_unordered(ProbeSchedule, PointerGetDatum(node));
+	}
+
+	binaryheap_build(ProbeSchedule);
+}
+
+/*
+ * Return the nearest deadline of polling, or PG_INT64_MAX if we don't poll to
+ * any node.
+ */
+int64
+nextProbeDeadline(void)
+{
+	KeeperNode *node;
+
+	if (ProbeSchedule == NULL || binaryheap_empty(ProbeSchedule))
+		return PG_INT64_MAX;
+
+	node = (KeeperNode *) DatumGetPointer(binaryheap_first(ProbeSchedule));
+
+	return node->next_probe;
+}
+
+/*
+ * Take the nodes whose deadline has come, and schedule their next polling.
+ * The nodes are stored into *due, which is valid until the schedule is rebuilt,
+ * and the number of them is returned. How late we are for each deadline is
+ * recorded in probe_lateness.
+ */
+int
+takeDueProbes(int64 now, KeeperNode ***due)
+{
+	int ndue = 0;
+
+	*due = DueProbes;
+
+	if (ProbeSchedule == NULL)
+		return 0;
+
+	while (!binaryheap_empty(ProbeSchedule))
+	{
+		KeeperNode *node;
+		int64 lateness;
+
+		node = (KeeperNode *) DatumGetPointer(binaryheap_first(ProbeSchedule));
+		if (node->next_probe > now)
+			break;
+
+		lateness = now - node->next_probe;
+		node->probe_lateness = lateness;
+		if (lateness >= node->probe_interval)
+			ereport(DEBUG1,
+					(errmsg("pg_keeper is late for polling to \"%s\" by " INT64_FORMAT " ms, skipping missed deadlines",
+							node->name, lateness / 1000)));
+
+		node->next_probe = nextFixedDeadline(node->next_probe,
+											 node->probe_interval, now);
+		binaryheap_replace_first(ProbeSchedule, PointerGetDatum(node));
+
+		DueProbes[ndue++] = node;
+	}
+
+	return ndue;
+}
+
+/*
+ * Make all scheduled nodes due now, used when polling is requested.
+ */
+void
+expediteProbes(int64 now)
+{
+	int i;
+
+	if (ProbeSchedule == NULL)
+		return;
+
+	for (i = 0; i < ProbeSchedule->bh_size; i++)
+	{
+		KeeperNode *node = (KeeperNode *) DatumGetPointer(ProbeSchedule->bh_nodes[i]);
+
+		node->next_probe = now;
+	}
+}
+
+/*
+ * Adjust the interval of the scheduled nodes to the result of the last polling,
+ * which must be called after polling. The next deadline of a node is moved to
+ * as if it had been scheduled with the new interval.
+ */
+void
+adaptProbeSchedule(void)
+{
+	bool changed = false;
+	int i;
+
+	if (ProbeSchedule == NULL)
+		return;
+
+	for (i = 0; i < ProbeSchedule->bh_size; i++)
+	{
+		KeeperNode *node = (KeeperNode *) DatumGetPointer(ProbeSchedule->bh_nodes[i]);
+		int64 interval = getProbeInterval(node);
+
+		if (interval == node->probe_interval)
+			continue;
+
+		ereport(DEBUG1,
+				(errmsg("pg_keeper changes the interval of polling to \"%s\" to " INT64_FORMAT " ms",
+						node->name, interval / 1000)));
+
+		node->next_probe += interval - node->probe_interval;
+		node->probe_interval = interval;
+		changed = true;
+	}
+
+	/* Deadlines are moved in both directions, so reorder all of them */
+	if (changed)
+		binaryheap_build(ProbeSchedule);
+}
+
+/*
+ * Return the deadline following given one by interval. The deadlines already
+ * passed are skipped so that a late wakeup doesn't cause a burst of polling.
+ */
+int64
+nextFixedDeadline(int64 deadline, int64 interval, int64 now)
+{
+	deadline += interval;
+
+	if (deadline <= now)
+		deadline += ((now - deadline) / interval + 1) * interval;
+
+	return deadline;
+}
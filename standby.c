@@ -10,6 +10,7 @@
 #include "postgres.h"
 
 #include "pg_keeper.h"
+#include "heartbeat.h"
 #include "syncrep.h"
 #include "util.h"
 
@@ -17,29 +18,39 @@
 #include "access/xlog.h"
 #include "miscadmin.h"
 #include "postmaster/bgworker.h"
+#include "replication/walreceiver.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "storage/proc.h"
 #include "storage/shmem.h"
+#include "storage/spin.h"
 
 /* these headers are used by this particular worker's code */
 #include "tcop/utility.h"
 #include "libpq-int.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
 #include "utils/ps_status.h"
+#include "utils/timestamp.h"
 
 bool	KeeperMainStandby(void);
 void	setupKeeperStandby(void);
 
 static bool doPromote(void);
 static void doAfterCommand(void);
-static bool heartbeatServerStandby(int *retry_counts);
+static bool heartbeatServerStandby(KeeperNode **due, int ndue);
+static bool replicationStreamIsAlive(KeeperNode *master);
+static int	selectIndirectProbes(KeeperProbe *probes, const char *sql,
+								 int fanout);
+static int	masterInClusterView(PGresult *res, KeeperNode *master);
+
+#define KEEPER_SQL_CLUSTER_VIEW "SELECT name, is_master, reachable, last_probe_age, g.version FROM (SELECT %s AS version) g LEFT JOIN pgkeeper.cluster_view() ON true"
 
 /* GUC variables */
 char	*keeper_after_command;
-
-/* Variables for heartbeat */
-static int *retry_counts;
+int		keeper_stream_liveness_time;
+int		keeper_indirect_probe_fanout;
 
 /*
  * Set up several parameters for standby mode.
@@ -54,8 +65,7 @@ setupKeeperStandby()
 	/* Initialize own cache if pg_keeper is already installed */
 	if (checkExtensionInstalled())
 	{
-		updateLocalCache(false);
-		retry_counts = resetRetryCounts(retry_counts);
+		updateLocalCache();
 	}
 }
 
@@ -65,56 +75,103 @@ setupKeeperStandby()
 bool
 KeeperMainStandby(void)
 {
+	int64	next_polling = getMonotonicTime();
+
 	/*
 	 * Main loop: do this until the SIGTERM handler tells us to terminate
 	 */
 	while (!got_sigterm)
 	{
 		int		rc;
+		int64	now;
+		KeeperCommandSet commands;
+		KeeperNode **due;
+		int		ndue;
+		bool	polling;
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
 		 * instead, they may wait on their process latch, which sleeps as
 		 * necessary, but is awakened if postmaster dies.  That way the
 		 * background process goes away immediately in an emergency.
+		 * We sleep until the next polling time or the deadline of polling to
+		 * the master, so that the interval of polling doesn't include the
+		 * time spent for polling itself.
 		 */
 		rc = WaitLatch(&MyProc->procLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   keeper_keepalives_time * 1000L);
+					   getTimeoutUntil(Min(next_polling, nextProbeDeadline())));
 		ResetLatch(&MyProc->procLatch);
 
+		/* Free everything the last tick allocated */
+		MemoryContextReset(KeeperTickContext);
+		MemoryContextSwitchTo(KeeperTickContext);
+
 		/* Emergency bailout if postmaster has died */
 		if (rc & WL_POSTMASTER_DEATH)
 			return false;
 
-		/* If got SIGHUP, reload the configuration file */
-		if (got_sighup)
+		/* Receive the commands from backends at once */
+		receiveKeeperCommands(&commands);
+
+		/* If got SIGHUP or asked, reload the configuration file */
+		if (got_sighup || commands.reload_config)
 		{
 			got_sighup = false;
 			ProcessConfigFile(PGC_SIGHUP);
 			parse_synchronous_standby_names();
+
+			/* The next master follows the master server regardless of ours */
+			updateNodeRoles(KeeperRepNodes, nKeeperRepNodes);
+			buildProbeSchedule();
+			publishClusterState();
 		}
 
-		/* If got SIGUSR1, update local cache for KeeperRepNodes */
-		if (got_sigusr1)
+		/*
+		 * If got commands from backends or SIGUSR1, update local cache for
+		 * KeeperRepNodes. The commands are sent after the modification is
+		 * committed, so we don't need to wait for it. The modification made
+		 * on the master server is noticed by its invalidation after it's
+		 * replayed. Accepting the invalidation costs a transaction, so we
+		 * check it only at the polling time on fixed rate.
+		 */
+		if (commands.reload_nodes || got_sigusr1 ||
+			(getMonotonicTime() >= next_polling && nodeInfoInvalidated()))
 		{
 			got_sigusr1 = false;
-			pg_usleep(5 * 1000L * 100L);
 
 			/* Update own memeory */
-			updateLocalCache(false);
+			updateLocalCache();
+		}
 
-			/* Update retry_counts information */
-			retry_counts = resetRetryCounts(retry_counts);
+		/* Start polling immediately if asked */
+		if (commands.force_probe)
+		{
+			next_polling = getMonotonicTime();
+			expediteProbes(next_polling);
 		}
 
 		/*
-		 * Pooling to master server. If heartbeat is failed, increment retry_count.
-		 * As a result of polling, if retry_count is reached to
-		 * keeper_keepalives_count, do promote the standby server to master server,
-		 * and exit.
+		 * If we were woken up by the latch before the next polling time and
+		 * the master is not due, go back to sleep. Both are advanced on fixed
+		 * rate.
+		 */
+		now = getMonotonicTime();
+		ndue = takeDueProbes(now, &due);
+		polling = (now >= next_polling);
+		if (!polling && ndue == 0)
+			continue;
+		if (polling)
+			next_polling = nextFixedDeadline(next_polling,
+											 keeper_keepalives_time * 1000L, now);
+
+		/*
+		 * Pooling to master server. If heartbeat is failed, record it to the
+		 * failure detector of the master. As a result of polling, if the detector
+		 * regards the master as failed, do promote the standby server to master
+		 * server, and exit.
 		 */
-		if (!got_sigterm && !heartbeatServerStandby(retry_counts))
+		if (!got_sigterm && ndue > 0 && !heartbeatServerStandby(due, ndue))
 		{
 			bool ret;
 
@@ -132,9 +189,21 @@ KeeperMainStandby(void)
 
 			/* Change to status of this node to master mode */
 			current_status = KEEPER_MASTER_READY;
-			updateLocalCache(false);
+			updateLocalCache();
+			buildProbeSchedule();
 			return true;
 		}
+
+		/* Spread and learn the membership with other keepers */
+		if (polling)
+			gossipTick();
+
+		/* Poll to the suspected nodes more frequently, or relax it */
+		if (ndue > 0)
+			adaptProbeSchedule();
+
+		/* Publish the result of polling to backends */
+		publishClusterState();
 	}
 
 	return false;
@@ -206,99 +275,341 @@ doAfterCommand(void)
 
 /*
  * heartbeatServerStandby()
- * Polling to master server directly and indirectly via other standbys. Return false
- * iif we could not poll to master via all standbys including itself.
+ * Polling to master server directly if it's in due, and fetching the cluster
+ * views of other standbys. Return false iif we could not poll to master neither
+ * directly nor via other standbys.
+ *
+ * If pg_keeper.indirect_probe_fanout is 0, we fetch the cluster views of all
+ * other standbys along with the direct polling. Otherwise we work like SWIM:
+ * poll to the master directly first, and only if it failed, ask randomly chosen
+ * indirect_probe_fanout standbys within the rest of the polling interval. Since
+ * different standbys are chosen at each round, the suspicion is confirmed or
+ * refuted by the failure detector within bounded number of rounds, while the
+ * number of probes sent by one standby doesn't grow as standbys are added.
  */
 static bool
-heartbeatServerStandby(int *retry_counts)
+heartbeatServerStandby(KeeperNode **due, int ndue)
 {
-#define KEEPER_SQL_INDIRECT_POOLING "SELECT pgkeeper.indirect_polling('%s')"
 	int i;
-	char *master_conninfo = NULL;
-	bool retry_count_reached = false;
+	KeeperNode *master = NULL;
+	KeeperProbe *probes;
+	int nprobes = 0;
+	int n_alive = 0;
+	int n_dead = 0;
+	bool swim = (keeper_indirect_probe_fanout > 0);
+	bool ret = true;
+	const char *heartbeat_sql;
+	const char *view_sql;
+	int64 start = getMonotonicTime();
+	int64 interval;
+	int64 now;
 
 	/* Get master server connection information */
-	for (i = 0; i < nKeeperRepNodes; i++)
+	for (i = 0; i < ndue; i++)
 	{
-		KeeperNode *node = &(KeeperRepNodes[i]);
-
-		if (node->is_master)
+		if (due[i]->is_master)
 		{
-			master_conninfo = node->conninfo;
+			master = due[i];
 			break;
 		}
 	}
 
-	Assert(master_conninfo);
+	/* Not the time to poll to master yet */
+	if (master == NULL)
+		return true;
+
+	/*
+	 * Each polling must be done within keepalives time, even if the master is
+	 * suspected and polled more frequently.
+	 */
+	interval = keeper_keepalives_time * 1000L;
+
+	/*
+	 * The WAL receiver has heard from the master recently, which is as good as
+	 * a heartbeat. We don't need to poll to the master in this case.
+	 */
+	if (replicationStreamIsAlive(master))
+	{
+		recordNodeHeartbeat(master, start);
+		recordNodeObservation(master, true, -1);
+		return true;
+	}
+
+	/* Sized for KeeperRepNodes when the cache was installed */
+	probes = KeeperProbeBuffer;
+
+	/* Both polling carry our membership version */
+	heartbeat_sql = getGossipSQL(KEEPER_SQL_GOSSIP);
+	view_sql = getGossipSQL(KEEPER_SQL_CLUSTER_VIEW);
+
+	/* Polling to master directly */
+	probes[nprobes].node = master;
+	probes[nprobes].sql = heartbeat_sql;
+	probes[nprobes].keep_result = true;
+	nprobes++;
+
+	/*
+	 * In SWIM mode, give the direct polling the first half of the interval so
+	 * that the indirect probes can be completed within the rest.
+	 */
+	if (swim)
+	{
+		/* Interrupted by SIGTERM, don't make any decision */
+		if (!probeNodes(probes, nprobes, Max((long) (interval / 2000), 1)))
+			goto done;
+
+		if (probes[0].status == PROBE_DONE)
+		{
+			/* The master is alive, no need to ask other standbys */
+			recordNodeObservation(master, true, probes[0].rtt);
+			recordNodeHeartbeat(master, getMonotonicTime());
+			gossipReceive(master, probes[0].res, 0);
+			goto done;
+		}
+
+		recordNodeObservation(master, false, -1);
+		n_dead++;
+	}
+
+	/* Fetch the cluster views of other standbys */
+	nprobes += selectIndirectProbes(&(probes[nprobes]), view_sql,
+									swim ? keeper_indirect_probe_fanout :
+									nKeeperRepNodes);
 
 	/*
-	 * Polling to the all servers. Return if pg_keeper made a dicision to
+	 * Polling to the all servers at once. Return if pg_keeper made a dicision to
 	 * not be able to continue steaming replication. The standby server always
-	 * polling to master via all standby server indirectly. If all result of polling
-	 * via all standbys is false more then keeper_keepalives_count in a row the
-	 * we decide to promote. That's a our promoting policy.
+	 * polling to master directly, and learns how other standbys see the master
+	 * from their cluster views. If no one could reach the master and the failure
+	 * detector of the master regards it as failed, we decide to promote. That's
+	 * a our promoting policy.
 	 */
-	for (i = 0; i < nKeeperRepNodes; i++)
+	if (!probeNodes(&(probes[swim ? 1 : 0]), nprobes - (swim ? 1 : 0),
+					getTimeoutUntil(start + interval)))
 	{
-		KeeperNode *node = &(KeeperRepNodes[i]);
-		char *connstr = node->conninfo;
-		bool ret;
-		char sql[BUFSIZE];
-		bool indirect_ret;
+		/* Interrupted by SIGTERM, don't make any decision */
+		goto done;
+	}
 
-		/*
-		 * We are not insterested in master server directly beacause
-		 * polling to master will be executed by execute indirectly
-		 * polling by itself.
-		 */
-		if (node->is_master)
-			continue;
+	now = getMonotonicTime();
 
-		/* Polling to master indirectly via other standby including itself */
-		snprintf(sql, BUFSIZE, KEEPER_SQL_INDIRECT_POOLING, master_conninfo);
-		ret = execSQL(connstr, sql, &indirect_ret);
+	/* Result of direct polling, which other standbys may ask us */
+	if (!swim)
+	{
+		if (probes[0].status == PROBE_DONE)
+		{
+			recordNodeObservation(master, true, probes[0].rtt);
+			gossipReceive(master, probes[0].res, 0);
+			n_alive++;
+		}
+		else
+		{
+			recordNodeObservation(master, false, -1);
+			n_dead++;
+		}
+	}
+
+	for (i = 1; i < nprobes; i++)
+	{
+		KeeperNode *node = probes[i].node;
+		int view;
 
-		if (!ret)
+		if (probes[i].status != PROBE_DONE)
 		{
 			/* Emit warning log */
 			ereport(LOG,
-					(errmsg("neighbor standby server seems to be falied:\"%s\"",
-							connstr)));
-
-			/* Neighbor standby migit be not available, ignore this result */
+					(errmsg("could not fetch the cluster view from neighbor standby server \"%s\", ignoring it",
+							node->conninfo)));
+
+			/*
+			 * The neighbor might be not available, or its polling to a
+			 * black-holed master might have timed out. Either way it tells
+			 * nothing about the master, so this is inconclusive. The miss of
+			 * the master is still counted below unless anyone reached it.
+			 */
+			recordNodeMiss(node);
+			recordNodeObservation(node, false, -1);
 			continue;
 		}
 
-		if (!indirect_ret)
+		/* Neighbor standby itself is alive anyway */
+		recordNodeHeartbeat(node, now);
+		recordNodeObservation(node, true, probes[i].rtt);
+		gossipReceive(node, probes[i].res, 4);
+
+		view = masterInClusterView(probes[i].res, master);
+
+		if (view < 0)
 		{
 			/* Neighbor standby says that the master server might be not available */
-			(retry_counts[i])++;
+			n_dead++;
 
 			/* Emit warning log */
 			ereport(LOG,
-					(errmsg("failed to indirect polling to master server via \"%s\" at %d time(s)",
-							connstr, retry_counts[i])));
+					(errmsg("failed to indirect polling to master server via \"%s\"",
+							node->conninfo)));
+		}
+		else if (view > 0)
+		{
+			/* Neighbor standby could connect to the master recently */
+			n_alive++;
+		}
+	}
+
+	/* The master is alive if anyone could reach it */
+	if (n_alive > 0)
+	{
+		recordNodeHeartbeat(master, now);
+		goto done;
+	}
+
+	recordNodeMiss(master);
+
+	ereport(LOG,
+			(errmsg("failed to poll to master server directly and indirectly at %d time(s), phi %.2f",
+					master->detector.misses, detectorPhi(&(master->detector), now))));
+
+	/*
+	 * The failure detector regards the master as failed, which means this standby
+	 * could not connect not only the master but also other standbys could not
+	 * connect to master server as well.
+	 */
+	if (detectorFailed(&(master->detector), now))
+		ret = false;
 
-			/* Check if retry_counts exceeds the threshold */
-			if (retry_counts[i] > keeper_keepalives_count)
-				retry_count_reached = true;
-			else
-				retry_count_reached = false;
+done:
+	for (i = 0; i < nprobes; i++)
+	{
+		if (probes[i].res != NULL)
+			PQclear(probes[i].res);
+	}
+
+	return ret;
+}
 
+/*
+ * Fill probes with up to fanout other standbys to fetch their cluster views
+ * using sql, and return the number of them. If there are more candidates than fanout,
+ * they are chosen at random. Standbys which we could reach at the last polling
+ * are preferred, since asking a failed standby tells us nothing.
+ */
+static int
+selectIndirectProbes(KeeperProbe *probes, const char *sql, int fanout)
+{
+	KeeperNode **candidates;
+	int ncandidates = 0;
+	int nreachable = 0;
+	int nprobes;
+	int i;
+
+	candidates = KeeperCandidateBuffer;
+
+	for (i = 0; i < nKeeperRepNodes; i++)
+	{
+		KeeperNode *node = &(KeeperRepNodes[i]);
+
+		/*
+		 * We are not insterested in master server beacause it's polled
+		 * directly, and in itself as well.
+		 */
+		if (node->is_master ||
+			pg_strcasecmp(node->name, keeper_node_name) == 0)
 			continue;
-		}
 
-		/* Success to connect to the master indirectly */
-		retry_counts[i] = 0;
+		/* Keep the reachable standbys at the head of candidates */
+		if (node->reachable || node->last_probe == 0)
+		{
+			candidates[ncandidates] = candidates[nreachable];
+			candidates[nreachable++] = node;
+		}
+		else
+			candidates[ncandidates] = node;
+		ncandidates++;
 	}
 
+	nprobes = Min(fanout, ncandidates);
+
 	/*
-	 * retry_count_reached is true, which means this standby could not connect not only
-	 * the master but also other standbys could not connect to master server as well.
+	 * Partial Fisher-Yates shuffle, choosing from the reachable standbys first
+	 * and then from the others if not enough.
 	 */
-	if (retry_count_reached)
+	for (i = 0; i < nprobes; i++)
+	{
+		int lo = i;
+		int hi = (i < nreachable) ? nreachable : ncandidates;
+		int j = lo + (int) (random() % (hi - lo));
+		KeeperNode *tmp = candidates[i];
+
+		candidates[i] = candidates[j];
+		candidates[j] = tmp;
+
+		probes[i].node = candidates[i];
+		probes[i].sql = sql;
+		probes[i].keep_result = true;
+	}
+
+	return nprobes;
+}
+
+/*
+ * Look up the master in the cluster view fetched from a neighbor standby. Return
+ * 1 if the neighbor observed the master reachable recently, -1 if observed it
+ * unreachable recently, or 0 if the neighbor's observation is too old or missing.
+ * Recently means within twice of our keepalives time, allowing the neighbor to
+ * miss one polling.
+ */
+static int
+masterInClusterView(PGresult *res, KeeperNode *master)
+{
+	int i;
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		double age;
+
+		if (pg_strcasecmp(PQgetvalue(res, i, 0), master->name) != 0 ||
+			!str_to_bool(PQgetvalue(res, i, 1)))
+			continue;
+
+		/* The neighbor has never observed the master */
+		if (PQgetisnull(res, i, 3))
+			return 0;
+
+		age = strtod(PQgetvalue(res, i, 3), NULL);
+		if (age > 2.0 * keeper_keepalives_time)
+			return 0;
+
+		return str_to_bool(PQgetvalue(res, i, 2)) ? 1 : -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Return true if the WAL receiver is streaming and has received any message
+ * from the master within pg_keeper.stream_liveness_time. We read the state of
+ * WAL receiver from shared memory, so this costs no connection. The latest WAL
+ * position reported by the master is remembered as well.
+ */
+static bool
+replicationStreamIsAlive(KeeperNode *master)
+{
+	WalRcvData *walrcv = WalRcv;
+	WalRcvState state;
+	TimestampTz last_receipt;
+
+	SpinLockAcquire(&walrcv->mutex);
+	state = walrcv->walRcvState;
+	last_receipt = walrcv->lastMsgReceiptTime;
+	master->stream_flush = walrcv->latestWalEnd;
+	SpinLockRelease(&walrcv->mutex);
+
+	if (keeper_stream_liveness_time == 0)
 		return false;
 
-	return true;
+	if (state != WALRCV_STREAMING)
+		return false;
 
+	return !TimestampDifferenceExceeds(last_receipt, GetCurrentTimestamp(),
+									   keeper_stream_liveness_time);
 }
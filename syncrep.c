@@ -18,14 +18,57 @@
 #include "storage/proc.h"
 #include "tcop/tcopprot.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
 #include "utils/ps_status.h"
 
+#include "pg_keeper.h"
 #include "syncrep.h"
+#include "util.h"
+
+/* Index of RepConfig->member_names by case-insensitive name */
+typedef struct SyncMemberEntry
+{
+	const char *name;		/* hash key, points into RepConfig */
+	int priority;			/* position in the list, 0 is the highest */
+} SyncMemberEntry;
 
 SyncRepConfigData *RepConfig = NULL;
+static HTAB *SyncMemberIndex = NULL;
+
+/* The value of synchronous_standby_names we parsed last time, and the result */
+static char *parsed_standby_names = NULL;
+static bool parsed_ok = false;
 
+static bool parseStandbyNames(void);
+static void buildSyncMemberIndex(void);
+
+/*
+ * Parse synchronous_standby_names into RepConfig. The result is kept until the
+ * value is changed, so this is cheap to call on every reload.
+ */
 bool parse_synchronous_standby_names(void)
 {
+	if (parsed_standby_names != NULL &&
+		strcmp(parsed_standby_names, SyncRepStandbyNames) == 0)
+		return parsed_ok;
+
+	if (parsed_standby_names != NULL)
+		free(parsed_standby_names);
+	parsed_standby_names = strdup(SyncRepStandbyNames);
+
+	parsed_ok = parseStandbyNames();
+
+	return parsed_ok;
+}
+
+/*
+ * Run the parser of synchronous_standby_names, and replace RepConfig with the
+ * result. RepConfig is left as it is if failed.
+ */
+static bool
+parseStandbyNames(void)
+{
+	SyncRepConfigData *config;
 	int parse_rc;
 
 	syncrep_parse_result = NULL;
@@ -46,11 +89,77 @@ bool parse_synchronous_standby_names(void)
 	}
 
 	/* GUC extra value must be malloc'd, not palloc'd */
-	RepConfig = (SyncRepConfigData *)
-		malloc(syncrep_parse_result->config_size);
-	if (RepConfig == NULL)
+	config = (SyncRepConfigData *) malloc(syncrep_parse_result->config_size);
+	if (config == NULL)
+	{
+		pfree(syncrep_parse_result);
 		return false;
-	memcpy(RepConfig, syncrep_parse_result, syncrep_parse_result->config_size);
+	}
+	memcpy(config, syncrep_parse_result, syncrep_parse_result->config_size);
+	pfree(syncrep_parse_result);
+	syncrep_parse_result = NULL;
+
+	/* The index points into RepConfig, so replace both at once */
+	if (RepConfig != NULL)
+		free(RepConfig);
+	RepConfig = config;
+	buildSyncMemberIndex();
 
 	return true;
 }
+
+/*
+ * Rebuild the index of the members listed in RepConfig. The same name may be
+ * listed more than once, in which case the left one is indexed.
+ */
+static void
+buildSyncMemberIndex(void)
+{
+	HASHCTL ctl;
+	const char *standby_name;
+	int i;
+
+	if (SyncMemberIndex != NULL)
+		hash_destroy(SyncMemberIndex);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(const char *);
+	ctl.entrysize = sizeof(SyncMemberEntry);
+	ctl.hash = keeperNameHash;
+	ctl.match = keeperNameMatch;
+	SyncMemberIndex = hash_create("pg_keeper sync member index",
+								  Max(RepConfig->nmembers, 16), &ctl,
+								  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+
+	standby_name = RepConfig->member_names;
+	for (i = 0; i < RepConfig->nmembers; i++)
+	{
+		SyncMemberEntry *entry;
+		bool found;
+
+		entry = (SyncMemberEntry *) hash_search(SyncMemberIndex, &standby_name,
+												HASH_ENTER, &found);
+		if (!found)
+			entry->priority = i;
+
+		standby_name += strlen(standby_name) + 1;
+	}
+}
+
+/*
+ * Return the position of given name in synchronous_standby_names, 0 is the
+ * highest priority, or -1 if it's not listed.
+ */
+int
+getSyncMemberPriority(const char *name)
+{
+	SyncMemberEntry *entry;
+
+	if (SyncMemberIndex == NULL)
+		return -1;
+
+	entry = (SyncMemberEntry *) hash_search(SyncMemberIndex, &name,
+											HASH_FIND, NULL);
+
+	return (entry != NULL) ? entry->priority : -1;
+}
@@ -12,3 +12,4 @@
 extern SyncRepConfigData *RepConfig;
 
 extern bool parse_synchronous_standby_names(void);
+extern int getSyncMemberPriority(const char *name);
@@ -10,27 +10,105 @@
 #include "postgres.h"
 #include "pg_keeper.h"
 
+#include <time.h>
+
 #include "access/xlog.h"
+#include "access/genam.h"
+#include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/reloptions.h"
 #include "access/xact.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_type.h"
 #include "commands/extension.h"
 #include "executor/spi.h"
 #include "miscadmin.h"
 #include "libpq-int.h"
+#include "pgstat.h"
 #include "replication/walsender.h"
+#include "replication/walsender_private.h"
+#include "storage/spin.h"
 #include "tcop/utility.h"
 #include "utils/snapmgr.h"
 #include "utils/acl.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
 #include "utils/ps_status.h"
 #include "utils/rel.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 
+#include "heartbeat.h"
 #include "syncrep.h"
 #include "util.h"
 
+/* Index of KeeperRepNodes by case-insensitive name, see findNodeByName() */
+typedef struct KeeperNodeEntry
+{
+	const char *name;		/* hash key, points to the name of node */
+	KeeperNode *node;
+} KeeperNodeEntry;
+
+static HTAB *KeeperNodeIndex = NULL;
+
+/* Memory context holding KeeperRepNodes and their strings */
+MemoryContext KeeperCacheContext = NULL;
+
+/* Memory context for the allocations in a tick, reset by the main loops */
+MemoryContext KeeperTickContext = NULL;
+
+/* Memory context current when the transaction began */
+static MemoryContext keeper_caller_context = NULL;
+
+/* Generation of the management table we loaded last time */
+int64	KeeperNodeInfoGeneration = -1;
+
+/*
+ * seqno of the next master decided by the master server, 0 if it decided none
+ * and -1 if it has not stored it yet.
+ */
+int		KeeperStoredNextMaster = -1;
+
+/* Oid of the management table, and whether it's invalidated */
+static Oid	node_info_relid = InvalidOid;
+static bool node_info_invalidated = false;
+
+static int64 getStoredGeneration(int *next_master);
+static Oid	getKeeperRelid(const char *relname, bool missing_ok);
+static void nodeInfoRelcacheCallback(Datum arg, Oid relid);
+static void extensionSyscacheCallback(Datum arg, int cacheid, uint32 hashvalue);
+static void buildNodeIndex(KeeperNode *nodes, int num);
+static KeeperNode *readNodeInfo(MemoryContext cxt, int *num, int *n_changed);
+static int	getNodeInfoAttnum(TupleDesc tupdesc, const char *attname, Oid atttype);
+
+/*
+ * Begin new transaction. The memory context current now is restored by
+ * endKeeperTransaction(), since committing leaves TopMemoryContext current.
+ */
+void
+beginKeeperTransaction(void)
+{
+	keeper_caller_context = CurrentMemoryContext;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+}
+
+/*
+ * Commit the transaction begun by beginKeeperTransaction().
+ */
+void
+endKeeperTransaction(void)
+{
+	CommitTransactionCommand();
+
+	MemoryContextSwitchTo(keeper_caller_context);
+}
+
 /*
  * Exec given SQL and handle the error.
  */
@@ -59,6 +137,88 @@ spiSQLExec(const char* sql, bool newtx)
 	return true;
 }
 
+/*
+ * Statements on the management table, indexed by KeeperPlanId. Each of them
+ * is prepared at the first execution and kept for the rest of the session, so
+ * we don't parse and plan it again.
+ */
+static struct
+{
+	const char *sql;
+	int			nargs;
+	Oid			argtypes[6];
+	SPIPlanPtr	plan;
+} KeeperPlans[NUM_KEEPER_PLANS] =
+{
+	/* KEEPER_PLAN_ALL_NODES */
+	{"SELECT * FROM " KEEPER_MANAGE_TABLE_NAME " ORDER BY seqno",
+	 0, {InvalidOid}, NULL},
+	/* KEEPER_PLAN_ADD_NODE */
+	{"INSERT INTO " KEEPER_MANAGE_TABLE_NAME " (name, conninfo, is_master, generation) VALUES ($1, $2, $3, $4)",
+	 4, {TEXTOID, TEXTOID, BOOLOID, INT8OID}, NULL},
+	/* KEEPER_PLAN_DELETE_BY_SEQNO */
+	{"DELETE FROM " KEEPER_MANAGE_TABLE_NAME " WHERE seqno = $1",
+	 1, {INT4OID}, NULL},
+	/* KEEPER_PLAN_DELETE_BY_NAME */
+	{"DELETE FROM " KEEPER_MANAGE_TABLE_NAME " WHERE name = $1",
+	 1, {TEXTOID}, NULL},
+	/* KEEPER_PLAN_NEXT_GENERATION */
+	{"UPDATE " KEEPER_GENERATION_TABLE_NAME " SET generation = generation + 1 RETURNING generation",
+	 0, {InvalidOid}, NULL},
+	/* KEEPER_PLAN_DELETE_MASTER */
+	{"DELETE FROM " KEEPER_MANAGE_TABLE_NAME " WHERE is_master",
+	 0, {InvalidOid}, NULL},
+	/* KEEPER_PLAN_UPDATE_NEW_MASTER */
+	{"UPDATE " KEEPER_MANAGE_TABLE_NAME " SET is_master = true, generation = $1 WHERE seqno = $2",
+	 2, {INT8OID, INT4OID}, NULL},
+	/* KEEPER_PLAN_SET_NEXT_MASTER */
+	{"UPDATE " KEEPER_GENERATION_TABLE_NAME " SET next_master = $1",
+	 1, {INT4OID}, NULL}
+};
+
+/*
+ * Execute the statement of given id with given parameters, preparing it if not
+ * yet, and handle the error. This must be called within SPI connection.
+ */
+bool
+execKeeperPlan(KeeperPlanId id, Datum *values, bool read_only)
+{
+	int ret;
+
+	if (KeeperPlans[id].plan == NULL)
+	{
+		SPIPlanPtr plan;
+
+		plan = SPI_prepare(KeeperPlans[id].sql, KeeperPlans[id].nargs,
+						   KeeperPlans[id].argtypes);
+		if (plan == NULL)
+			ereport(ERROR,
+					(errmsg("failed to prepare \"%s\": %s",
+							KeeperPlans[id].sql,
+							SPI_result_code_string(SPI_result))));
+
+		if (SPI_keepplan(plan) != 0)
+			ereport(ERROR,
+					(errmsg("failed to keep plan of \"%s\"", KeeperPlans[id].sql)));
+
+		KeeperPlans[id].plan = plan;
+	}
+
+	ret = SPI_execute_plan(KeeperPlans[id].plan, values, NULL, read_only, 0);
+
+	if (ret != SPI_OK_SELECT && ret != SPI_OK_UPDATE &&
+		ret != SPI_OK_INSERT && ret != SPI_OK_DELETE &&
+		ret != SPI_OK_UPDATE_RETURNING)
+	{
+		ereport(WARNING,
+				(errmsg("failed to execute CRUD to fetch node_info table, status %d :\"%s\"",
+						ret, KeeperPlans[id].sql)));
+		return false;
+	}
+
+	return true;
+}
+
 /*
  * Open given relaltion and return Relation.
  */
@@ -86,49 +246,30 @@ get_rel_from_relname(text *relname, LOCKMODE lockmode, AclMode aclmode)
  * within transaction.
  */
 void
-addNewNode(TupleDesc tupdesc, text *node_name, text *conninfo,
-		   bool is_master, bool is_nextmaster, bool is_sync)
+addNewNode(text *node_name, text *conninfo, bool is_master)
 {
-#define KEEPER_SQL_ADDNODE "INSERT INTO %s (name, conninfo, is_master, is_nextmaster, is_sync) VALUES($1, $2, $3, $4, $5)"
-
-	SPIPlanPtr plan;
-	StringInfoData sql;
-	Oid argtypes[KEEPER_NUM_ATTS];
-	Datum values[KEEPER_NUM_ATTS];
-	int ret;
-
-	/* Fill argtypes out by Oids of data type */
-	argtypes[0] = SPI_gettypeid(tupdesc, 2);
-	argtypes[1] = SPI_gettypeid(tupdesc, 3);
-	argtypes[2] = SPI_gettypeid(tupdesc, 4);
-	argtypes[3] = SPI_gettypeid(tupdesc, 5);
-	argtypes[4] = SPI_gettypeid(tupdesc, 6);
-
-	initStringInfo(&sql);
-	appendStringInfo(&sql, KEEPER_SQL_ADDNODE, KEEPER_MANAGE_TABLE_NAME);
-
-	plan = SPI_prepare(sql.data, KEEPER_NUM_ATTS, argtypes);
+	Datum values[KEEPER_NUM_ATTS + 1];
 
 	values[0] = PointerGetDatum(node_name);
 	values[1] = PointerGetDatum(conninfo);
 	values[2] = BoolGetDatum(is_master);
-	values[3] = BoolGetDatum(is_nextmaster);
-	values[4] = BoolGetDatum(is_sync);
+	values[3] = Int64GetDatum(getNodeInfoGeneration());
 
-	ret = SPI_execp(plan, values, NULL, 1);
+	execKeeperPlan(KEEPER_PLAN_ADD_NODE, values, false);
 }
 
 bool
 deleteNodeBySeqno(int seqno)
 {
-#define KEEPER_SQL_DELETE_BY_SEQNO "DELETE FROM %s WHERE seqno = %d"
-	StringInfoData sql;
+	Datum values[1];
 	bool ret;
 
-	initStringInfo(&sql);
-	appendStringInfo(&sql, KEEPER_SQL_DELETE_BY_SEQNO, KEEPER_MANAGE_TABLE_NAME,
-					 seqno);
-	ret = spiSQLExec(sql.data, false);
+	values[0] = Int32GetDatum(seqno);
+	ret = execKeeperPlan(KEEPER_PLAN_DELETE_BY_SEQNO, values, false);
+
+	/* Deleted rows are noticed by the new generation */
+	if (ret && SPI_processed > 0)
+		getNodeInfoGeneration();
 
 	return ret;
 }
@@ -136,14 +277,173 @@ deleteNodeBySeqno(int seqno)
 bool
 deleteNodeByName(const char *name)
 {
-#define KEEPER_SQL_DELETE_BY_NAME "DELETE FROM %s WHERE name = '%s'"
-	StringInfoData sql;
+	Datum values[1];
 	bool ret;
 
-	initStringInfo(&sql);
-	appendStringInfo(&sql, KEEPER_SQL_DELETE_BY_NAME, KEEPER_MANAGE_TABLE_NAME,
-					 name);
-	ret = spiSQLExec(sql.data, false);
+	values[0] = CStringGetTextDatum(name);
+	ret = execKeeperPlan(KEEPER_PLAN_DELETE_BY_NAME, values, false);
+
+	/* Deleted rows are noticed by the new generation */
+	if (ret && SPI_processed > 0)
+		getNodeInfoGeneration();
+
+	return ret;
+}
+
+/*
+ * Return the generation of the modification to the management table made by
+ * current (sub)transaction, which must be stored into the generation column of
+ * modified rows. The first call in a transaction increments the generation of
+ * the management table, which also serializes the concurrent modifications.
+ */
+int64
+getNodeInfoGeneration(void)
+{
+	static TransactionId generation_xid = InvalidTransactionId;
+	static int64 generation = 0;
+	bool isNull;
+
+	if (TransactionIdEquals(generation_xid, GetCurrentTransactionId()))
+		return generation;
+
+	if (!execKeeperPlan(KEEPER_PLAN_NEXT_GENERATION, NULL, false) ||
+		SPI_processed != 1)
+		ereport(ERROR,
+				(errmsg("failed to increment the generation of node_info table")));
+
+	generation = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+											 SPI_tuptable->tupdesc, 1, &isNull));
+	generation_xid = GetCurrentTransactionId();
+
+	/*
+	 * Send relcache invalidation for the management table at commit. It's
+	 * written to the commit record, so keepers on standby servers notice
+	 * the modification when it's replayed. See nodeInfoInvalidated().
+	 */
+	CacheInvalidateRelcacheByRelid(getKeeperRelid(KEEPER_MANAGE_TABLE_RELNAME,
+												  false));
+
+	return generation;
+}
+
+/*
+ * Return the current generation of the management table, read by scanning the
+ * table directly. The seqno of the next master stored along with it is stored
+ * into next_master, or -1 if none is stored. This must be called within transaction
+ * having active snapshot.
+ */
+static int64
+getStoredGeneration(int *next_master)
+{
+	Relation rel;
+	HeapScanDesc scan;
+	HeapTuple tuple;
+	int64 generation = -1;
+
+	*next_master = -1;
+
+	rel = heap_open(getKeeperRelid(KEEPER_GENERATION_TABLE_RELNAME, false),
+					AccessShareLock);
+	scan = heap_beginscan(rel, GetActiveSnapshot(), 0, NULL);
+
+	if ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Datum value;
+		bool isNull;
+
+		value = heap_getattr(tuple, 1, RelationGetDescr(rel), &isNull);
+		if (!isNull)
+			generation = DatumGetInt64(value);
+
+		value = heap_getattr(tuple, 2, RelationGetDescr(rel), &isNull);
+		*next_master = isNull ? -1 : DatumGetInt32(value);
+	}
+
+	heap_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	if (generation < 0)
+		ereport(WARNING,
+				(errmsg("failed to fetch the generation of node_info table")));
+
+	return generation;
+}
+
+/*
+ * Return the Oid of given relation in pg_keeper schema. This must be called
+ * within transaction.
+ */
+static Oid
+getKeeperRelid(const char *relname, bool missing_ok)
+{
+	Oid nspid;
+	Oid relid;
+
+	nspid = get_namespace_oid(KEEPER_SCHEMA_NAME, missing_ok);
+	if (!OidIsValid(nspid))
+		return InvalidOid;
+
+	relid = get_relname_relid(relname, nspid);
+	if (!OidIsValid(relid) && !missing_ok)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("relation \"%s.%s\" does not exist",
+						KEEPER_SCHEMA_NAME, relname),
+				 errhint("Execute ALTER EXTENSION pg_keeper UPDATE on the master server.")));
+
+	return relid;
+}
+
+/*
+ * Register the callbacks to learn the modification of the management table
+ * and the extension, which are invoked when we accept invalidation messages.
+ */
+void
+registerNodeInfoCallbacks(void)
+{
+	CacheRegisterRelcacheCallback(nodeInfoRelcacheCallback, (Datum) 0);
+	CacheRegisterSyscacheCallback(EXTENSIONOID, extensionSyscacheCallback,
+								  (Datum) 0);
+}
+
+static void
+nodeInfoRelcacheCallback(Datum arg, Oid relid)
+{
+	if (relid == InvalidOid || relid == node_info_relid)
+		node_info_invalidated = true;
+}
+
+static void
+extensionSyscacheCallback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	/* pg_keeper might be created or dropped, look up the table again */
+	node_info_relid = InvalidOid;
+	node_info_invalidated = true;
+}
+
+/*
+ * Return true if the management table has been modified since the last call
+ * or reload. We learn it from relcache invalidation, which is sent by the
+ * modification on the master server and replayed on the standby servers, so
+ * the keeper on the standby server doesn't need to be told by anyone. Nothing
+ * wakes us up when it's replayed, and starting transaction accepts the
+ * invalidation messages, so this begins new transaction and could not be
+ * called in transaction.
+ */
+bool
+nodeInfoInvalidated(void)
+{
+	bool ret;
+
+	beginKeeperTransaction();
+
+	if (!OidIsValid(node_info_relid))
+		node_info_relid = getKeeperRelid(KEEPER_MANAGE_TABLE_RELNAME, true);
+
+	endKeeperTransaction();
+
+	ret = node_info_invalidated && OidIsValid(node_info_relid);
+	node_info_invalidated = false;
 
 	return ret;
 }
@@ -174,22 +474,13 @@ checkExtensionInstalled(void)
 SPITupleTable *
 getAllRepNodes(int *num, bool newtx)
 {
-#define KEEPER_SQL_ASTER "SELECT * FROM %s ORDER BY seqno"
-	int ret;
-	StringInfoData sql;
-
 	if (newtx)
 		START_SPI_TRANSACTION();
 
 	/* We check if pg_keeper is already craated first */
 	if (get_extension_oid("pg_keeper", true) != InvalidOid)
 	{
-		initStringInfo(&sql);
-		appendStringInfo(&sql, KEEPER_SQL_ASTER, KEEPER_MANAGE_TABLE_NAME);
-
-		ret = SPI_exec(sql.data, 0);
-
-		if (ret != SPI_OK_SELECT)
+		if (!execKeeperPlan(KEEPER_PLAN_ALL_NODES, NULL, true))
 			ereport(WARNING,
 					(errmsg("failed to execute SELECT to fetch node_info table.")));
 
@@ -202,82 +493,400 @@ getAllRepNodes(int *num, bool newtx)
 	return SPI_tuptable;
 }
 
-/* Return the number of connecting standbys */
+/*
+ * Return the number of connecting standbys. We look at the walsenders in shared
+ * memory directly rather than pg_stat_replication.
+ */
 int
 getNumberOfConnectingStandbys(void)
 {
-#define KEEPER_SQL_STAT_REPLICATION "SELECT * FROM pg_stat_replication"
 	int n_standbys = 0;
+	int i;
 
-	START_SPI_TRANSACTION();
+	for (i = 0; i < max_wal_senders; i++)
+	{
+		WalSnd *walsnd = &(WalSndCtl->walsnds[i]);
+		pid_t pid;
 
-	spiSQLExec(KEEPER_SQL_STAT_REPLICATION, false);
-	n_standbys = SPI_processed;
+		SpinLockAcquire(&walsnd->mutex);
+		pid = walsnd->pid;
+		SpinLockRelease(&walsnd->mutex);
 
-	END_SPI_TRANSACTION();
+		if (pid != 0)
+			n_standbys++;
+	}
 
 	return n_standbys;
 }
 
+/*
+ * Update the replication activity of the standbys in KeeperRepNodes by reading
+ * the walsenders in shared memory, and set stream_alive of each standby. The
+ * flush position is published to the registry as well.
+ *
+ * The walsender doesn't remember when the standby replied last time, so we
+ * regard the standby as alive if it's streaming and its write or flush position
+ * advanced within pg_keeper.stream_liveness_time. An idle standby has nothing
+ * to report, so it's left to the polling.
+ */
+void
+updateStreamState(int64 now)
+{
+	typedef struct
+	{
+		pid_t pid;
+		XLogRecPtr write;
+		XLogRecPtr flush;
+	} KeeperWalSnd;
+	static KeeperWalSnd *walsnds = NULL;
+	int n_walsnds = 0;
+	int numbackends;
+	int i, j;
+
+	for (i = 0; i < nKeeperRepNodes; i++)
+		KeeperRepNodes[i].stream_alive = false;
+
+	/* Collect the streaming walsenders */
+	/* max_wal_senders can't be changed without restart */
+	if (walsnds == NULL)
+		walsnds = MemoryContextAlloc(TopMemoryContext,
+									 sizeof(KeeperWalSnd) * max_wal_senders);
+	for (i = 0; i < max_wal_senders; i++)
+	{
+		WalSnd *walsnd = &(WalSndCtl->walsnds[i]);
+		KeeperWalSnd copy;
+		bool streaming;
+
+		SpinLockAcquire(&walsnd->mutex);
+		copy.pid = walsnd->pid;
+		copy.write = walsnd->write;
+		copy.flush = walsnd->flush;
+		streaming = (walsnd->state == WALSNDSTATE_STREAMING);
+		SpinLockRelease(&walsnd->mutex);
+
+		if (copy.pid == 0 || !streaming)
+			continue;
+
+		walsnds[n_walsnds++] = copy;
+	}
+
+	/*
+	 * Identify the standby of each walsender by its application_name, which is
+	 * the same as pg_keeper.node_name of the standby.
+	 */
+	numbackends = (n_walsnds > 0) ? pgstat_fetch_stat_numbackends() : 0;
+	for (i = 1; i <= numbackends; i++)
+	{
+		LocalPgBackendStatus *local = pgstat_fetch_stat_local_beentry(i);
+		PgBackendStatus *beentry;
+		KeeperWalSnd *state = NULL;
+		KeeperNode *node;
+
+		if (local == NULL)
+			continue;
+		beentry = &(local->backendStatus);
+
+		for (j = 0; j < n_walsnds; j++)
+		{
+			if (walsnds[j].pid == beentry->st_procpid)
+			{
+				state = &(walsnds[j]);
+				break;
+			}
+		}
+
+		if (state == NULL)
+			continue;
+
+		if ((node = findNodeByName(beentry->st_appname)) == NULL)
+			continue;
+
+		if (state->write != node->stream_write ||
+			state->flush != node->stream_flush)
+		{
+			node->stream_write = state->write;
+			node->stream_flush = state->flush;
+			node->stream_progress = now;
+		}
+
+		node->stream_alive = (keeper_stream_liveness_time > 0 &&
+							  node->stream_progress != 0 &&
+							  now - node->stream_progress <=
+							  keeper_stream_liveness_time * 1000L);
+	}
+
+	pgstat_clear_snapshot();
+}
+
 /*
  * Update its own local cache information about RepNodes. Note that thi
  * fucntion bein new transaction, so could not be called in transaction.
- * while updating own cache, send SIGUSR1 indirectly to all stnadbys if
- * propagete is true.
+ *
+ * We compare the generation of the management table with the one we loaded
+ * last time first, and do nothing if it's not changed. Otherwise the table is
+ * read by scanning its index directly, without parser and planner, and only the
+ * rows modified since then are copied, others are taken over from the current
+ * cache.
+ *
+ * The generation is the membership version as well, which other keepers learn
+ * by gossip. See gossip.c. A standby may have pulled newer membership than its
+ * replica of the table, in which case we keep the pulled one until the replay
+ * catches up with it. The table on the master server is always authoritative.
  */
 void
-updateLocalCache(bool propagate)
+updateLocalCache(void)
 {
-#define KEEPER_SQL_INDIRECT_KILL "SELECT pgkeeper.indirect_kill('SIGUSR1')"
-	SPITupleTable *tuptable;
-	TupleDesc tupdesc;
-	int i;
 	int num;
-	Relation rel;
+	int n_changed;
+	int64 generation;
+	int next_master;
+	KeeperNode *nodes;
+	MemoryContext cxt;
 
-	START_SPI_TRANSACTION();
-
-	/* Prepare relation */
-	rel = get_rel_from_relname(cstring_to_text(KEEPER_MANAGE_TABLE_NAME), AccessShareLock,
-							   ACL_SELECT);
-	tupdesc = rel->rd_att;
+	beginKeeperTransaction();
+	PushActiveSnapshot(GetTransactionSnapshot());
 
-	/* Get node information from table */
-	tuptable = getAllRepNodes(&num, false);
+	/* The invalidations accepted so far are covered by this reload */
+	node_info_invalidated = false;
 
-	if (num == 0)
+	/*
+	 * Nothing has been changed since we loaded last time, or the replica of
+	 * the table is older than what we have pulled. If we could not fetch the
+	 * generation, we can't tell which rows to read, so keep the current cache
+	 * rather than installing a partial one, and retry at the next reload.
+	 */
+	generation = getStoredGeneration(&next_master);
+	if (generation < 0 ||
+		generation == KeeperNodeInfoGeneration ||
+		(RecoveryInProgress() && generation < KeeperMembershipVersion))
 	{
-		/* table is empty */
+		PopActiveSnapshot();
+		endKeeperTransaction();
+
+		/* The next master may be changed even if we keep the pulled nodes */
+		if (generation >= 0 && next_master != KeeperStoredNextMaster)
+		{
+			KeeperStoredNextMaster = next_master;
+			updateNodeRoles(KeeperRepNodes, nKeeperRepNodes);
+			publishClusterState();
+		}
+
+		set_ps_display(getStatusPsString(current_status, nKeeperRepNodes), false);
+		return;
 	}
 
-	/* Intialize */
-	if (KeeperRepNodes)
-		free(KeeperRepNodes);
+	cxt = createCacheContext();
+	nodes = readNodeInfo(cxt, &num, &n_changed);
 
-	KeeperRepNodes = malloc(sizeof(KeeperNode) * num);
+	PopActiveSnapshot();
+	endKeeperTransaction();
 
-	for (i = 0; i < num; i++)
+	ereport(DEBUG1,
+			(errmsg("pg_keeper reads %d of %d nodes of generation " INT64_FORMAT,
+					n_changed, num, generation)));
+
+	KeeperNodeInfoGeneration = generation;
+	KeeperMembershipVersion = generation;
+	KeeperStoredNextMaster = next_master;
+
+	installLocalCache(cxt, nodes, num);
+}
+
+/*
+ * Read all rows of the management table in seqno order by scanning its seqno
+ * index, and return them as nodes allocated in cxt. The number of nodes is
+ * stored into num. The rows not modified since the generation we loaded are
+ * copied from the current cache rather than detoasted, and the number of other
+ * rows is stored into n_changed. This must be called within transaction having
+ * active snapshot.
+ */
+static KeeperNode *
+readNodeInfo(MemoryContext cxt, int *num, int *n_changed)
+{
+	Relation rel;
+	Relation index;
+	TupleDesc tupdesc;
+	IndexScanDesc scan;
+	HeapTuple tuple;
+	KeeperNode *nodes;
+	Datum *values;
+	bool *nulls;
+	int att_seqno;
+	int att_name;
+	int att_conninfo;
+	int att_is_master;
+	int att_generation;
+	int size = nKeeperRepNodes + 8;
+	int j = 0;
+	int64 now = getMonotonicTime();
+
+	rel = heap_open(getKeeperRelid(KEEPER_MANAGE_TABLE_RELNAME, false),
+					AccessShareLock);
+	index = index_open(getKeeperRelid(KEEPER_MANAGE_INDEX_RELNAME, false),
+					   AccessShareLock);
+	tupdesc = RelationGetDescr(rel);
+
+	/*
+	 * The columns are looked up by name, since the table upgraded from older
+	 * version has dropped columns and the added ones at the end.
+	 */
+	att_seqno = getNodeInfoAttnum(tupdesc, "seqno", INT4OID);
+	att_name = getNodeInfoAttnum(tupdesc, "name", TEXTOID);
+	att_conninfo = getNodeInfoAttnum(tupdesc, "conninfo", TEXTOID);
+	att_is_master = getNodeInfoAttnum(tupdesc, "is_master", BOOLOID);
+	att_generation = getNodeInfoAttnum(tupdesc, "generation", INT8OID);
+
+	values = palloc(sizeof(Datum) * tupdesc->natts);
+	nulls = palloc(sizeof(bool) * tupdesc->natts);
+
+	nodes = MemoryContextAlloc(cxt, sizeof(KeeperNode) * size);
+	*num = 0;
+	*n_changed = 0;
+
+	/* Without any scan key, the index returns all rows in seqno order */
+	scan = index_beginscan(rel, index, GetActiveSnapshot(), 0, 0);
+	index_rescan(scan, NULL, 0, NULL, 0);
+
+	while ((tuple = index_getnext(scan, ForwardScanDirection)) != NULL)
 	{
-		HeapTuple tuple = tuptable->vals[i];
-		bool isNull;
+		KeeperNode *node;
+
+		heap_deform_tuple(tuple, tupdesc, values, nulls);
 
-		KeeperRepNodes[i].seqno = SPI_getbinval(tuple, tupdesc, 1, &isNull);
-		KeeperRepNodes[i].name = strdup(SPI_getvalue(tuple, tupdesc, 2));
-		KeeperRepNodes[i].conninfo = strdup(SPI_getvalue(tuple, tupdesc, 3));
-		KeeperRepNodes[i].is_master = SPI_getbinval(tuple, tupdesc, 4, &isNull);
-		KeeperRepNodes[i].is_nextmaster = SPI_getbinval(tuple, tupdesc, 5, &isNull);
-		KeeperRepNodes[i].is_sync = SPI_getbinval(tuple, tupdesc, 6, &isNull);
+		if (*num >= size)
+		{
+			size *= 2;
+			nodes = repalloc(nodes, sizeof(KeeperNode) * size);
+		}
+
+		node = &(nodes[(*num)++]);
+		node->seqno = DatumGetInt32(values[att_seqno - 1]);
+
+		/* The current cache is sorted by seqno as well */
+		while (j < nKeeperRepNodes && KeeperRepNodes[j].seqno < node->seqno)
+			j++;
+
+		/*
+		 * Take over the unchanged node from the current cache. The strings
+		 * are copied since the current cache is going to be freed at once.
+		 */
+		if (j < nKeeperRepNodes && KeeperRepNodes[j].seqno == node->seqno &&
+			!nulls[att_generation - 1] &&
+			DatumGetInt64(values[att_generation - 1]) <=
+			KeeperNodeInfoGeneration)
+		{
+			node->name = MemoryContextStrdup(cxt, KeeperRepNodes[j].name);
+			node->conninfo = MemoryContextStrdup(cxt, KeeperRepNodes[j].conninfo);
+			node->is_master = KeeperRepNodes[j].is_master;
+		}
+		else
+		{
+			node->name = MemoryContextStrdup(cxt,
+						TextDatumGetCString(values[att_name - 1]));
+			node->conninfo = MemoryContextStrdup(cxt,
+						nulls[att_conninfo - 1] ? "" :
+						TextDatumGetCString(values[att_conninfo - 1]));
+			node->is_master = (!nulls[att_is_master - 1] &&
+							   DatumGetBool(values[att_is_master - 1]));
+			(*n_changed)++;
+		}
 
-		/* Send kill indirectly except for master server */
-		if (propagate && !(KeeperRepNodes[i].is_master))
-			execSQL(KeeperRepNodes[i].conninfo, KEEPER_SQL_INDIRECT_KILL, NULL);
+		initNodeState(node, now);
 	}
 
+	index_endscan(scan);
+	index_close(index, AccessShareLock);
+	heap_close(rel, AccessShareLock);
+
+	pfree(values);
+	pfree(nulls);
+
+	return nodes;
+}
+
+/*
+ * Return the attribute number of given column of the management table, and
+ * check its type. Raise an error if the table doesn't have such column, for
+ * example because the extension has not been updated yet.
+ */
+static int
+getNodeInfoAttnum(TupleDesc tupdesc, const char *attname, Oid atttype)
+{
+	int attnum = SPI_fnumber(tupdesc, attname);
+
+	if (attnum <= 0 || tupdesc->attrs[attnum - 1]->atttypid != atttype)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("column \"%s\" of %s has unexpected definition",
+						attname, KEEPER_MANAGE_TABLE_NAME),
+				 errhint("Execute ALTER EXTENSION pg_keeper UPDATE on the master server.")));
+
+	return attnum;
+}
+
+/*
+ * Initialize the state of node which isn't given by the management table.
+ */
+void
+initNodeState(KeeperNode *node, int64 now)
+{
+	node->conn = NULL;
+	resetDetector(&(node->detector), now);
+	node->stream_write = InvalidXLogRecPtr;
+	node->stream_flush = InvalidXLogRecPtr;
+	node->stream_progress = 0;
+	node->stream_alive = false;
+	node->reachable = false;
+	node->last_probe = 0;
+	node->last_seen = 0;
+	node->rtt = -1;
+	node->next_probe = now;
+	node->probe_interval = 0;
+	node->probe_lateness = 0;
+}
+
+/*
+ * Create a memory context for new node cache. Everything of the cache is
+ * allocated in it, and it becomes KeeperCacheContext by installLocalCache().
+ */
+MemoryContext
+createCacheContext(void)
+{
+	return AllocSetContextCreate(TopMemoryContext,
+								 "pg_keeper node cache",
+								 ALLOCSET_SMALL_SIZES);
+}
+
+/*
+ * Replace KeeperRepNodes with given nodes allocated in cxt, and publish it. The
+ * memory of the current cache is freed at once.
+ */
+void
+installLocalCache(MemoryContext cxt, KeeperNode *nodes, int num)
+{
+	/* Index new nodes first, inheritNodeState() looks them up */
+	buildNodeIndex(nodes, num);
+
+	/* The polling uses these instead of allocating at each time */
+	allocProbeBuffers(cxt, num);
+
+	/* Keep using heartbeat connections and history of the unchanged nodes */
+	inheritNodeState(KeeperRepNodes, nKeeperRepNodes);
+
+	/* Intialize */
+	if (KeeperCacheContext != NULL)
+		MemoryContextDelete(KeeperCacheContext);
+
+	KeeperCacheContext = cxt;
+	KeeperRepNodes = nodes;
 	nKeeperRepNodes = num;
 
-	relation_close(rel, AccessShareLock);
+	/* The roles are not given by the management table */
+	updateNodeRoles(KeeperRepNodes, nKeeperRepNodes);
+	storeNextMaster();
+	buildProbeSchedule();
 
-	END_SPI_TRANSACTION();
+	publishClusterState();
 
 	set_ps_display(getStatusPsString(current_status, nKeeperRepNodes), false);
 	ereport(LOG, (errmsg("pg_keeper updates own cache, currently number of nodes is %d",
@@ -285,42 +894,171 @@ updateLocalCache(bool propagate)
 }
 
 /*
- * Pfree and palloc again the given retry_counts.
+ * Hash function and comparison function for the indexes keyed by name, which
+ * is compared case-insensitively like pg_strcasecmp(). The key is a pointer to
+ * the name, so the indexed name must live as long as the index.
  */
-int *
-resetRetryCounts(int *retry_counts)
+uint32
+keeperNameHash(const void *key, Size keysize)
 {
-	if (retry_counts)
-		pfree(retry_counts);
+	const unsigned char *name = *((const unsigned char * const *) key);
+	uint32 hash = 2166136261U;
 
-	retry_counts = palloc0(sizeof(int) * nKeeperRepNodes);
+	/* FNV-1a of the lower-cased name */
+	for (; *name; name++)
+	{
+		hash ^= (unsigned char) pg_tolower(*name);
+		hash *= 16777619U;
+	}
 
-	return retry_counts;
+	return hash;
+}
+
+int
+keeperNameMatch(const void *key1, const void *key2, Size keysize)
+{
+	return pg_strcasecmp(*((const char * const *) key1),
+						 *((const char * const *) key2));
 }
 
 /*
- * Return true if give name is regarded as the next master.
+ * Rebuild the index of nodes by name, which are going to be KeeperRepNodes.
+ * Names differing only in case are the same node for us, so the one having
+ * lower seqno is indexed.
  */
-bool
-isNextMaster(const char *name)
+static void
+buildNodeIndex(KeeperNode *nodes, int num)
 {
+	HASHCTL ctl;
 	int i;
-	bool ret = false;
 
-	for (i = 0; i < nKeeperRepNodes; i++)
+	if (KeeperNodeIndex != NULL)
+		hash_destroy(KeeperNodeIndex);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(const char *);
+	ctl.entrysize = sizeof(KeeperNodeEntry);
+	ctl.hash = keeperNameHash;
+	ctl.match = keeperNameMatch;
+	KeeperNodeIndex = hash_create("pg_keeper node index", Max(num, 16), &ctl,
+								  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+
+	for (i = 0; i < num; i++)
 	{
-		KeeperNode *node = &(KeeperRepNodes[i]);
+		KeeperNodeEntry *entry;
+		bool found;
 
-		if (node->is_nextmaster &&
-			pg_strcasecmp(name, node->name) == 0)
-		{
-			ret = true;
-			break;
-		}
+		entry = (KeeperNodeEntry *) hash_search(KeeperNodeIndex, &(nodes[i].name),
+												HASH_ENTER, &found);
+		if (!found)
+			entry->node = &(nodes[i]);
 	}
+}
 
-	/* Return true if there is any result by SQL */
-	return ret;
+/*
+ * Return the node having given name in KeeperRepNodes, or NULL.
+ */
+KeeperNode *
+findNodeByName(const char *name)
+{
+	KeeperNodeEntry *entry;
+
+	if (KeeperNodeIndex == NULL)
+		return NULL;
+
+	entry = (KeeperNodeEntry *) hash_search(KeeperNodeIndex, &name,
+											HASH_FIND, NULL);
+
+	return (entry != NULL) ? entry->node : NULL;
+}
+
+/*
+ * Forget the heartbeat history of all nodes, used when we restart monitoring.
+ */
+void
+resetAllDetectors(void)
+{
+	int64 now = getMonotonicTime();
+	int i;
+
+	for (i = 0; i < nKeeperRepNodes; i++)
+		resetDetector(&(KeeperRepNodes[i].detector), now);
+}
+
+/*
+ * Record the heartbeat of node to its failure detector, which we learned either
+ * directly or indirectly.
+ */
+void
+recordNodeHeartbeat(KeeperNode *node, int64 now)
+{
+	detectorHeartbeat(&(node->detector), now);
+	node->last_seen = GetCurrentTimestamp();
+}
+
+/*
+ * Record the failed polling to node to its failure detector.
+ */
+void
+recordNodeMiss(KeeperNode *node)
+{
+	detectorMiss(&(node->detector));
+}
+
+/*
+ * Record the result of our own observation of node, that is polling to it
+ * directly or replication activity with it. rtt is the round trip time in
+ * microseconds, or -1 if unknown. Since other standbys' indirect polling may
+ * be answered from this, never record the results learned indirectly here.
+ */
+void
+recordNodeObservation(KeeperNode *node, bool reachable, int64 rtt)
+{
+	node->reachable = reachable;
+	node->last_probe = GetCurrentTimestamp();
+	if (rtt >= 0)
+		node->rtt = rtt;
+}
+
+/*
+ * Return true if give name is regarded as the next master.
+ */
+bool
+isNextMaster(const char *name)
+{
+	KeeperNode *node = findNodeByName(name);
+
+	return (node != NULL && node->is_nextmaster);
+}
+
+/*
+ * Return the current time of monotonic clock in microseconds. Unlike
+ * GetCurrentTimestamp(), this is not affected by adjustment of the system
+ * clock, so we use this for scheduling the polling.
+ */
+int64
+getMonotonicTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64) ts.tv_sec * USECS_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/*
+ * Return the milliseconds until the given monotonic time, rounded up so that
+ * we don't wake up just before it. Return 0 if it's already passed.
+ */
+long
+getTimeoutUntil(int64 until)
+{
+	int64 diff = until - getMonotonicTime();
+
+	if (diff <= 0)
+		return 0;
+
+	return (long) ((diff + 999) / 1000);
 }
 
 /* Convert boolean string to bool value */
@@ -337,144 +1075,122 @@ str_to_bool(const char *string)
 }
 
 /*
- * It's assumed that parse_synrep_names is already called
- *
- *
+ * Determine is_sync and is_nextmaster of nodes sorted by seqno according to
+ * RepConfig. It's assumed that parse_synchronous_standby_names is already called.
  *
- * Update is_sync, is_nextmaster
- */
-/*
- * Determine the next master in case of failover and set the flag to a node. The next
- * master will selected using following priorities.
+ * The roles are derived from the membership and synchronous_standby_names of
+ * the master server. The master server computes them by itself, and stores only
+ * the next master along with the generation of the management table, see
+ * storeNextMaster(). Standbys follow the stored next master rather than their
+ * own synchronous_standby_names, so that they agree on which one promotes, and
+ * fall back to their own only until the master server stores it. The next
+ * master in case of failover will be selected using following priorities.
  * 1. The standby listed in synchronous_standby_names. Left is higher priority meaning
  * that the standby having higher sync_priority on pg_stat_replication will be selected.
  * 2. The standby listed on top of the management table meaning that if there are no sync
  * connecting standby, we select the fixed node which is listed on top of the management
  * table.
+ * No standby is selected if synchronous_standby_names lists nothing.
  */
-bool
-updateManageTableAccordingToSSNames(bool newtx)
+void
+updateNodeRoles(KeeperNode *nodes, int num)
 {
-#define KEEPER_SQL_ALL_FALSE "UPDATE %s SET is_nextmaster = false, is_sync = false"
-#define KEEPER_SQL_SET_NEXT_MASTER "UPDATE %s SET is_nextmaster = true WHERE seqno = %d"
-#define KEEPER_SQL_SET_SYNC_STANDBY "UPDATE %s SET is_sync = true WHERE seqno in (%s)"
-#define KEEPER_SQL_ALL_STANDBY_NODES "SELECT seqno, name FROM %s WHERE NOT is_master ORDER BY seqno"
-
-	SPITupleTable *tuptable;
-	int num;
-	int i, i_tup;
-	int reserve_seqno = -1;
-	char *standby_name;
-	int *sync_standbys;
-	int n_sync_standbys = 0;
-	int next_master_seqno = 0;
-	bool got_next_master_seqno = false;
-	StringInfoData sql;
-	TupleDesc tupdesc;
-	Relation rel;
+	KeeperNode *next_master = NULL;
+	KeeperNode *reserve = NULL;
+	int next_priority = 0;
+	int i;
 
-	if (newtx)
-		START_SPI_TRANSACTION();
+	for (i = 0; i < num; i++)
+	{
+		KeeperNode *node = &(nodes[i]);
+		int priority;
 
-	initStringInfo(&sql);
-	rel = get_rel_from_relname(cstring_to_text(KEEPER_MANAGE_TABLE_NAME), AccessShareLock,
-							   ACL_SELECT);
-	tupdesc = rel->rd_att;
+		node->is_nextmaster = false;
+		node->is_sync = false;
 
-	/* Set false to is_sync and is_nextmaster first */
-	appendStringInfo(&sql, KEEPER_SQL_ALL_FALSE, KEEPER_MANAGE_TABLE_NAME);
-	spiSQLExec(sql.data, false);
-	resetStringInfo(&sql);
+		/* Not interested in master server */
+		if (node->is_master)
+			continue;
 
-	/* Get all standby nodes information from management table */
-	appendStringInfo(&sql, KEEPER_SQL_ALL_STANDBY_NODES, KEEPER_MANAGE_TABLE_NAME);
-	spiSQLExec(sql.data, false);
-	resetStringInfo(&sql);
-	num = SPI_processed;
+		/* Reserve the standby having lowest seqno */
+		if (reserve == NULL)
+			reserve = node;
 
-	/*
-	 * 2. Set is_nextmaster = true to a appropriate node
-	 * We get the standby bein considered as a next master with following priority.
-	 *   1. The stnadby listed in synchronous_standby_names. Left is higher priority.
-	 *   2. The stnadby listed on top of the management table.
-	 */
-	tuptable = SPI_tuptable;
-	standby_name = RepConfig->member_names;
-	sync_standbys = (int *) palloc(sizeof(int) * num);
-	for (i = 0; i < RepConfig->nmembers; i++)
-	{
-		for (i_tup = 0; i_tup < num; i_tup++)
-		{
-			HeapTuple tuple = tuptable->vals[i_tup];
-			bool isNull;
+		if ((priority = getSyncMemberPriority(node->name)) < 0)
+			continue;
 
-			/* Reserve node having lowest seqno */
-			if (reserve_seqno == -1)
-				reserve_seqno = SPI_getbinval(tuple, tupdesc, 1, &isNull);
+		node->is_sync = true;
 
-			/* Found next new master server */
-			if (pg_strcasecmp(standby_name, SPI_getvalue(tuple, tupdesc, 2)) == 0)
-			{
-				int seqno =  SPI_getbinval(tuple, tupdesc, 1, &isNull);
-
-				/* Remenger the seqno of nextd master standby */
-				if (!got_next_master_seqno)
-				{
-					next_master_seqno = seqno;
-					got_next_master_seqno = true;
-				}
-
-				/* Remenber the seqno of sync standby */
-				sync_standbys[n_sync_standbys++] = seqno;
-			}
+		/* Left is higher priority, and lower seqno among the same priority */
+		if (next_master == NULL || priority < next_priority)
+		{
+			next_master = node;
+			next_priority = priority;
 		}
+	}
 
-		standby_name += strlen(standby_name) + 1;
+	/* Follow the decision of the master server, replicated to us */
+	if (RecoveryInProgress() && KeeperStoredNextMaster >= 0)
+	{
+		for (i = 0; i < num; i++)
+		{
+			if (nodes[i].seqno == KeeperStoredNextMaster && !nodes[i].is_master)
+				nodes[i].is_nextmaster = true;
+		}
+		return;
 	}
 
+	if (RepConfig == NULL || RepConfig->nmembers == 0)
+		return;
+
 	/*
-	 * If we could not find the next master connecting sync, we select th
+	 * If we could not find the next master connecting sync, we select the
 	 * top row
 	 */
-	if (!got_next_master_seqno)
-		next_master_seqno = reserve_seqno;
+	if (next_master == NULL)
+		next_master = reserve;
 
-	ereport(DEBUG1, (errmsg("udpate is_nextmaster column of \"%d\" row",
-							next_master_seqno)));
+	if (next_master != NULL)
+		next_master->is_nextmaster = true;
+}
 
-	/* Update is_nextmaster column */
-	appendStringInfo(&sql, KEEPER_SQL_SET_NEXT_MASTER,
-					 KEEPER_MANAGE_TABLE_NAME, next_master_seqno);
-	spiSQLExec(sql.data, false);
-	resetStringInfo(&sql);
+/*
+ * Store the next master we decided into the management table, if it's changed.
+ * This is done only by the master server, and bumps the generation so that the
+ * keepers on standby servers reload it when it's replayed. Must not be called
+ * within transaction.
+ */
+void
+storeNextMaster(void)
+{
+	Datum values[1];
+	int seqno = 0;
+	int i;
 
-	/*
-	 * Update sync standbys information.
-	 */
-	if (n_sync_standbys > 0)
-	{
-		StringInfoData buf;
-		char delimiter = ' ';
+	/* Standbys follow what the master server stored */
+	if (RecoveryInProgress())
+		return;
 
-		initStringInfo(&buf);
-		for (i = 0; i < n_sync_standbys; i++)
+	for (i = 0; i < nKeeperRepNodes; i++)
+	{
+		if (KeeperRepNodes[i].is_nextmaster)
 		{
-			appendStringInfo(&buf, "%c%d", delimiter, sync_standbys[i]);
-			delimiter = ',';
+			seqno = KeeperRepNodes[i].seqno;
+			break;
 		}
-
-		/* Update is_sync column */
-		appendStringInfo(&sql, KEEPER_SQL_SET_SYNC_STANDBY, KEEPER_MANAGE_TABLE_NAME,
-						 buf.data);
-		spiSQLExec(sql.data, false);
-
-		ereport(DEBUG1, (errmsg("update is_sync columns of \"%s\" seqno row", buf.data)));
 	}
 
-	relation_close(rel, AccessShareLock);
+	if (seqno == KeeperStoredNextMaster)
+		return;
 
-	if (newtx)
-		END_SPI_TRANSACTION();
+	START_SPI_TRANSACTION();
 
-	return true;
+	values[0] = Int32GetDatum(seqno);
+	if (execKeeperPlan(KEEPER_PLAN_SET_NEXT_MASTER, values, false))
+	{
+		getNodeInfoGeneration();
+		KeeperStoredNextMaster = seqno;
+	}
+
+	END_SPI_TRANSACTION();
 }
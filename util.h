@@ -20,8 +20,7 @@
 /* Macro for SPI start or end transaction */
 #define START_SPI_TRANSACTION() \
 	{ \
-		SetCurrentStatementStartTimestamp(); \
-		StartTransactionCommand(); \
+		beginKeeperTransaction(); \
 		SPI_connect(); \
 		PushActiveSnapshot(GetTransactionSnapshot()); \
 	} while(0)
@@ -29,24 +28,60 @@
 	{ \
 		SPI_finish(); \
 		PopActiveSnapshot(); \
-		CommitTransactionCommand(); \
+		endKeeperTransaction(); \
 	} while(0)
 
+/* Statements on the management table, see execKeeperPlan() */
+typedef enum KeeperPlanId
+{
+	KEEPER_PLAN_ALL_NODES = 0,
+	KEEPER_PLAN_ADD_NODE,
+	KEEPER_PLAN_DELETE_BY_SEQNO,
+	KEEPER_PLAN_DELETE_BY_NAME,
+	KEEPER_PLAN_NEXT_GENERATION,
+	KEEPER_PLAN_DELETE_MASTER,
+	KEEPER_PLAN_UPDATE_NEW_MASTER,
+	KEEPER_PLAN_SET_NEXT_MASTER,
+	NUM_KEEPER_PLANS
+} KeeperPlanId;
+
 /* Function prototypes */
 extern Relation get_rel_from_relname(text *relname, LOCKMODE lockmode,
 									 AclMode aclmode);
-extern void addNewNode(TupleDesc tupdesc, text *node_name, text *conninfo,
-					   bool is_master, bool is_nextmaster, bool is_sync);
+extern void addNewNode(text *node_name, text *conninfo, bool is_master);
 extern bool deleteNodeBySeqno(int seqno);
 extern bool deleteNodeByName(const char *name);
 extern int decideNextMaster(TupleDesc tupdesc, SPITupleTable tuptable);
 extern SPITupleTable *getAllRepNodes(int *num, bool newtx);
+extern void beginKeeperTransaction(void);
+extern void endKeeperTransaction(void);
 extern bool spiSQLExec(const char *sql, bool newtx);
+extern bool execKeeperPlan(KeeperPlanId id, Datum *values, bool read_only);
 extern void updateNextMaster(TupleDesc tupdesc);
-extern void updateLocalCache(bool propagate);
-extern int *resetRetryCounts(int *retry_counts);
+extern MemoryContext KeeperCacheContext;
+extern MemoryContext KeeperTickContext;
+extern int64 KeeperNodeInfoGeneration;
+extern int	KeeperStoredNextMaster;
+extern int64 getNodeInfoGeneration(void);
+extern void registerNodeInfoCallbacks(void);
+extern bool nodeInfoInvalidated(void);
+extern void updateLocalCache(void);
+extern void initNodeState(KeeperNode *node, int64 now);
+extern MemoryContext createCacheContext(void);
+extern void installLocalCache(MemoryContext cxt, KeeperNode *nodes, int num);
+extern void resetAllDetectors(void);
+extern void recordNodeHeartbeat(KeeperNode *node, int64 now);
+extern void recordNodeMiss(KeeperNode *node);
+extern void recordNodeObservation(KeeperNode *node, bool reachable, int64 rtt);
 extern bool isNextMaster(const char *name);
+extern KeeperNode *findNodeByName(const char *name);
+extern uint32 keeperNameHash(const void *key, Size keysize);
+extern int keeperNameMatch(const void *key1, const void *key2, Size keysize);
 extern bool str_to_bool(const char *string);
+extern int64 getMonotonicTime(void);
+extern long getTimeoutUntil(int64 until);
 extern bool checkExtensionInstalled(void);
-extern bool updateManageTableAccordingToSSNames(bool newtx);
+extern void updateNodeRoles(KeeperNode *nodes, int num);
+extern void storeNextMaster(void);
 extern int getNumberOfConnectingStandbys(void);
+extern void updateStreamState(int64 now);